@@ -226,6 +226,58 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return nread;
 }
 
+// Like serve_read, but rather than copying the data into the request
+// page, gather the block cache pages holding up to FSREAD_MAXPAGES
+// blocks of it into 'vec', to be mapped read-only into the client's
+// receive window.  The data starts at the offset's position within its
+// block.  Sets *nvec to the number of runs of pages in 'vec'.
+static int
+serve_read_map(envid_t envid, struct Fsreq_read *req, struct IpcVec *vec,
+	       int *nvec)
+{
+	struct OpenFile *o;
+	off_t off;
+	size_t n;
+	uint32_t bno;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	*nvec = 0;
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	off = o->o_fd->fd_offset;
+	if (off >= o->o_file->f_size)
+		return 0;
+	n = MIN(req->req_n, o->o_file->f_size - off);
+	n = MIN(n, FSREAD_MAXPAGES * BLKSIZE - off % BLKSIZE);
+
+	for (bno = off / BLKSIZE; bno * BLKSIZE < off + n; bno++) {
+		if ((r = file_get_block(o->o_file, bno, &blk)) < 0)
+			return r;
+		// Bring it into the block cache, so it can be sent
+		*(volatile char *) blk;
+		if (*nvec && (char *) vec[*nvec - 1].iv_va
+		    + vec[*nvec - 1].iv_npages * BLKSIZE == blk)
+			vec[*nvec - 1].iv_npages++;
+		else if (*nvec == IPC_MAXVEC) {
+			// Too scattered: return what we have
+			n = bno * BLKSIZE - off;
+			break;
+		} else {
+			vec[*nvec].iv_va = blk;
+			vec[*nvec].iv_npages = 1;
+			vec[*nvec].iv_perm = PTE_P | PTE_U;
+			(*nvec)++;
+		}
+	}
+
+	o->o_fd->fd_offset += n;
+	return n;
+}
+
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -314,12 +366,17 @@ void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int perm, r = 0, reply_perm = 0, nvec;
+	void *pg = NULL;
+	envid_t reply_to = 0;
+	struct IpcVec vec[IPC_MAXVEC];
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Reply to the last request, if any, and take the next
+		// one in the same system call
+		req = ipc_reply_wait(reply_to, r, pg, reply_perm,
+				     (int32_t *) &whom, fsreq, &perm);
+		reply_to = 0;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -332,16 +389,27 @@ serve(void)
 		}
 
 		pg = NULL;
+		nvec = 0;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ_MAP) {
+			r = serve_read_map(whom, &fsreq->read, vec, &nvec);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (nvec > 0) {
+			// The reply's pages are scattered over the block
+			// cache, so send it on its own.  If the client has
+			// gone away, so be it.
+			sys_ipc_send_vec(whom, r, vec, nvec);
+			continue;
+		}
+		// The next request's page replaces fsreq's mapping
+		reply_to = whom;
+		reply_perm = perm;
 	}
 }
 
@@ -349,9 +417,13 @@ void
 umain(int argc, char **argv)
 {
 	static_assert(sizeof(struct File) == 256);
+	static_assert(FSREAD_MAXPAGES <= IPC_MAXPAGES);
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// Stay on CPU 0, so the block cache stays warm in its caches.
+	sys_env_set_affinity(0, 1 << 0);
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
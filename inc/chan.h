@@ -0,0 +1,52 @@
+// Channels: one-way message rings from one environment to another
+// over shared memory.  See lib/chan.c for the details.
+
+#ifndef JOS_INC_CHAN_H
+#define JOS_INC_CHAN_H 1
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+#define CHAN_NDESC	64			// Messages a channel holds
+#define CHAN_DATASIZE	(8 * PGSIZE)		// Bytes of messages it holds
+
+// Pages a channel takes, from the page-aligned address it is set up at:
+// the ring, then the data area
+#define CHAN_NPAGES	(1 + CHAN_DATASIZE / PGSIZE)
+
+// A message in the data area
+struct ChanDesc {
+	uint32_t cd_pos;		// Data position of its first byte
+	uint32_t cd_len;		// Length in bytes
+};
+
+// The first page of a channel.  Counts and data positions only ever
+// grow; they are taken modulo CHAN_NDESC and CHAN_DATASIZE.
+struct ChanRing {
+	// Written by the producer
+	volatile uint32_t cr_tail;	// Messages sent
+	volatile uint32_t cr_dtail;	// Data position of the next one
+	volatile uint32_t cr_pwait;	// Producer may be waiting on cr_head
+
+	// Written by the consumer, on a cache line of its own
+	volatile uint32_t cr_head __attribute__((aligned(64)));	// Messages received
+	volatile uint32_t cr_cwait;	// Consumer may be waiting on cr_tail
+
+	volatile uint32_t cr_closed __attribute__((aligned(64))); // Closed by either side
+	struct ChanDesc cr_desc[CHAN_NDESC];
+};
+
+// One side's handle on a channel
+struct Chan {
+	struct ChanRing *ch_ring;
+	uint8_t *ch_data;
+};
+
+int	chan_create(struct Chan *c, void *va);
+void	chan_attach(struct Chan *c, void *va);
+int	chan_send(struct Chan *c, const void *buf, size_t len);
+ssize_t	chan_recv(struct Chan *c, void *buf, size_t len);
+bool	chan_isclosed(struct Chan *c);
+void	chan_close(struct Chan *c);
+
+#endif	// !JOS_INC_CHAN_H
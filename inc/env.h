@@ -38,6 +38,44 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priorities run from ENV_PRIO_MIN (the default) up to
+// ENV_PRIO_MAX; higher priorities always run first.
+#define ENV_PRIO_MIN		0
+#define ENV_PRIO_MAX		31
+#define ENV_NPRIO		(ENV_PRIO_MAX - ENV_PRIO_MIN + 1)
+
+// Scheduling classes.  Fixed-priority envs always run before fair
+// ones, strictly by priority.  Fair envs share the CPU in proportion
+// to a weight derived from their priority.
+enum {
+	ENV_SCHED_FAIR = 0,
+	ENV_SCHED_FIXED,
+};
+
+// An env's affinity is the set of CPUs it may run on, bit i standing
+// for CPU i.  New envs may run anywhere; forked ones inherit it.
+#define ENV_AFFINITY_ALL	0xffffffff
+
+// IPC can move several pages at once.  The page arguments of the IPC
+// system calls may name a run of up to IPC_MAXPAGES pages instead of a
+// single page: the page-aligned address of the first page, with the
+// number of pages minus one in the low bits.  A plain page-aligned
+// address still means one page.
+#define IPC_MAXPAGES		16
+#define IPC_PAGES(va, npages)	((void *) ((uintptr_t) (va) | ((npages) - 1)))
+#define IPC_PAGES_VA(a)		((uintptr_t) (a) & ~(PGSIZE - 1))
+#define IPC_PAGES_N(a)		(((uintptr_t) (a) & (PGSIZE - 1)) + 1)
+
+// sys_ipc_send_vec gathers the pages it sends from up to IPC_MAXVEC
+// runs of pages, which land one after another in the receiver.
+#define IPC_MAXVEC		8
+
+struct IpcVec {
+	void *iv_va;			// First page of the run
+	size_t iv_npages;		// Pages in the run
+	int iv_perm;			// Perm to map them with
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -54,26 +92,66 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_affinity;		// CPUs it may run on
+	uint32_t env_migrations;	// Runs on a different CPU than the last
+	struct Env *env_rq_next;	// Next env on the same run queue level
+	struct Env **env_rq_pprev;	// Pointer to us on that level
+	int env_rq_cpu;			// Run queue the env is on, or -1
+	int env_slice;			// Timer ticks in its current time slice
+	int env_heap_index;		// Position in a fair run queue's heap
+
+	// CPU accounting, in TSC cycles spent in user mode
+	unsigned env_sched_class;	// ENV_SCHED_FAIR or ENV_SCHED_FIXED
+	uint64_t env_runtime;		// Total
+	uint64_t env_vruntime;		// Scaled by weight; fair envs only
+	uint64_t env_exec_start;	// When it last entered user mode
+
+	// Timer wheel (kern/timer.c)
+	uint64_t env_timer;		// Wheel tick to wake it at, or 0
+	struct Env *env_timer_next;	// Next env in the same wheel slot
+	struct Env **env_timer_pprev;	// Pointer to us in that slot, or NULL
+
+	// Futex wait queue (kern/futex.c)
+	physaddr_t env_futex;		// Physical address it waits on, or 0
+	struct Env *env_futex_next;	// Next env in the same hash bucket
+	struct Env **env_futex_pprev;	// Pointer to us in that bucket, or NULL
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uint32_t env_cow_faults;	// Copy-on-write faults the kernel resolved
+	uint32_t env_cow_copies;	// Of those, the ones that copied the page
+
+	// Syscall ring (sys_ring_setup)
+	void *env_ring;			// User VA of its page, or NULL
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
-	void *env_ipc_dstva;		// VA at which to map received page
+	envid_t env_ipc_recv_from;	// Only from this env (a call), or 0
+	void *env_ipc_dstva;		// VA at which to map received pages
+	size_t env_ipc_dstpages;	// Pages that may be mapped there
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
-	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_perm;		// Perm of first page mapping received
+	size_t env_ipc_npages;		// Pages received
+
+	// Blocking send (kern/ipc.c)
+	envid_t env_ipc_send_to;	// Env it is blocked sending to, or 0
+	uint32_t env_ipc_send_value;	// Data value it is sending
+	struct IpcVec env_ipc_send_vec[IPC_MAXVEC]; // Pages it is sending
+	int env_ipc_send_nvec;		// Runs of pages in env_ipc_send_vec
+	struct Env *env_ipc_senders;	// Envs blocked sending to us
+	struct Env *env_ipc_send_next;	// Next env in the same sender queue
+	struct Env **env_ipc_send_pprev; // Pointer to us in that queue, or NULL
 
 	// Challenge: a fixed-priority scheduler
 	// allows each environment to be assigned a priority and
 	// ensures that higher-priority environments are always
 	// chosen in preference to lower-priority environments.
 	//
-	// Default: 0
+	// Default: ENV_PRIO_MIN
 	int priority;
 };
 
@@ -70,9 +70,16 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read_map takes a Fsreq_read like Read, but returns the data in
+	// the block cache pages holding it, mapped into the receive window
+	// from the page of the current offset on
+	FSREQ_READ_MAP
 };
 
+// Most pages FSREQ_READ_MAP returns at once
+#define FSREAD_MAXPAGES	16		// No more than IPC_MAXPAGES
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -21,6 +21,8 @@
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/malloc.h>
+#include <inc/chan.h>
+#include <inc/uthread.h>
 #include <inc/ns.h>
 #include <kern/e1000.h>
 
@@ -29,9 +31,15 @@
 // main user program
 void	umain(int argc, char **argv);
 
+// Per-thread data, in the page at UTLS, which every env has a copy of
+// even when it shares the rest of its memory (see sfork).
+struct Tls {
+	const volatile struct Env *tls_env;	// Our Env structure
+};
+
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+#define thisenv		(((struct Tls *) UTLS)->tls_env)
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -58,11 +66,32 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
+int	sys_page_map_large(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send_vec(envid_t to_env, uint32_t value,
+			 const struct IpcVec *vec, int nvec);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ring_setup(struct SysRing *ring);
+int	sys_ring_enter(void);
+envid_t	sys_fork(bool share);
+int	sys_ipc_recv_timeout(void *rcv_pg, uint32_t usec);
+int	sys_sleep(uint32_t usec);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t usec);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 unsigned int sys_time_msec(void);
+uint64_t sys_time_usec(void);
+uint64_t sys_time_nsec(void);
 // Challenge: a fixed-priority scheduler
-void    sys_env_set_priority(int priority);
+int     sys_env_set_priority(int priority);
+int	sys_env_set_sched_class(int sched_class);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 int     sys_send_data_at(void *addr, uint16_t len);
 int     sys_recv_data_at(void *addr, uint16_t len, struct recv_res *res);
 
@@ -87,11 +116,18 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_send_vec(envid_t to_env, uint32_t value, const struct IpcVec *vec,
+		     int nvec);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 uint32_t usec);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 // Challenge: a fixed-priority scheduler
 envid_t	pfork(int priority);
 envid_t	fork(void);
@@ -146,6 +182,11 @@ int	getchar(void);
 int	iscons(int fd);
 int	opencons(void);
 
+// sysring.c
+int	sysring_queue(uint32_t data, uint32_t num, uint32_t a1, uint32_t a2,
+		      uint32_t a3, uint32_t a4, uint32_t a5);
+int	sysring_flush(uint32_t *data_store);
+
 // pipe.c
 int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
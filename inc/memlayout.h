@@ -101,6 +101,11 @@
  *                     |      Normal User Stack       | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebfd000
  *                     |                              |
+ *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
+ *                     |      Thread-Local Page       | RW/RW  PGSIZE
+ *    UTLS, USTACKBASE +------------------------------+ 0xee800000
+ *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *                     .                              .
@@ -168,6 +173,11 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Bottom of the PTSIZE region under UTOP that holds the stacks.  sfork
+// shares everything below it, and gives each thread a copy of the rest.
+#define USTACKBASE	(UTOP - PTSIZE)
+// Thread-local page (struct Tls in inc/lib.h), at the bottom of that region
+#define UTLS		USTACKBASE
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -227,7 +237,25 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state (see kern/pmap.c).  pp_order is the order
+	// of the block this page heads, whether the block is free or was
+	// handed out by page_alloc_order.  pp_pprev links free blocks.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+	struct PageInfo **pp_pprev;
+
+	// Reverse map: the page table entries that map this page (see
+	// kern/pmap.c).  Zero, a single pte_t pointer, or, with bit 0
+	// set, a pointer to a chain of entries.  For a page table page,
+	// the page directory entry that points to it.
+	uintptr_t pp_rmap;
 };
 
+// Values of pp_flags in struct PageInfo
+#define PP_BUDDY	0x01	// Page heads a free block in the buddy allocator
+#define PP_PGTABLE	0x02	// Page is a page table made by pgdir_walk
+#define PP_SLAB		0x04	// Page is a slab of a kmem cache
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -65,10 +65,13 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user
+// processes are allowed to set them arbitrarily.  The kernel reads two
+// of them only when it copies an address space for sys_fork.
 // PTE_AVAIL = W | U | COW
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_COW		0x800	// Copy-on-write, as fork maps writable pages
+#define PTE_SHARE	0x400	// Shared with the child by fork, not copied
 
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
@@ -12,6 +12,11 @@ struct jif_pkt {
 	char jp_data[0];
 };
 
+// Requests may come with up to NSIPC_MAXPAGES pages, sent as one run
+// (see IPC_PAGES in inc/env.h): the Nsipc, and the pages that carry
+// the data of large sends and receives on past its end.
+#define NSIPC_MAXPAGES	4
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -22,7 +27,7 @@ enum {
 	NSREQ_CLOSE,
 	NSREQ_CONNECT,
 	NSREQ_LISTEN,
-	// Recv returns a Nsret_recv on the request page.
+	// Recv returns a Nsret_recv on the request pages.
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -22,7 +24,51 @@ enum {
 	SYS_env_set_priority,
 	SYS_send_data_at,
 	SYS_recv_data_at,
+	SYS_page_alloc_large,
+	SYS_page_map_large,
+	SYS_env_set_sched_class,
+	SYS_env_set_affinity,
+	SYS_time_usec,
+	SYS_time_nsec,
+	SYS_sleep,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_send_vec,
+	SYS_ring_setup,
+	SYS_ring_enter,
+	SYS_fork,
 	NSYSCALLS
 };
 
+// Syscall rings.  An environment queues system calls in the submission
+// queue of a page it has registered with sys_ring_setup, and has all of
+// them run in a single kernel entry with sys_ring_enter.  Their return
+// values come back in the completion queue, in order.  The counts only
+// ever grow, and are taken modulo the queue sizes.
+#define SYSRING_NSQ	64
+#define SYSRING_NCQ	128
+
+struct SysSqe {
+	uint32_t sqe_num;		// SYS_* number of the call
+	uint32_t sqe_args[5];		// Its arguments
+	uint32_t sqe_data;		// Handed back with its result
+};
+
+struct SysCqe {
+	uint32_t cqe_data;		// sqe_data of the call
+	int32_t cqe_result;		// Its return value
+};
+
+struct SysRing {
+	volatile uint32_t sr_sq_head;	// Calls taken, by the kernel
+	volatile uint32_t sr_sq_tail;	// Calls queued, by the env
+	volatile uint32_t sr_cq_head;	// Results taken, by the env
+	volatile uint32_t sr_cq_tail;	// Results posted, by the kernel
+	struct SysSqe sr_sq[SYSRING_NSQ];
+	struct SysCqe sr_cq[SYSRING_NCQ];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
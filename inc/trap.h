@@ -38,6 +38,8 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_TLB         20	// IPI: TLB shootdown (see kern/pmap.c)
+#define IRQ_RESCHED     21	// IPI: an env was queued (see kern/sched.c)
 
 #ifndef __ASSEMBLER__
 
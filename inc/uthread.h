@@ -0,0 +1,44 @@
+// User-level threads: environments that share their memory, made with
+// sfork, with mutexes and condition variables on futexes.  See
+// lib/uthread.c for the details.
+
+#ifndef JOS_INC_UTHREAD_H
+#define JOS_INC_UTHREAD_H 1
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// A thread is the environment running it
+typedef envid_t uthread_t;
+
+// Threads share only the memory that was mapped when they were
+// created, so mutexes and condition variables must be there too: in
+// global data, or on pages mapped before the threads that use them.
+// Never on a stack, which each thread has its own copy of.
+struct Umutex {
+	volatile uint32_t um_state;	// 0 free, 1 held, 2 held with waiters
+};
+
+struct Ucond {
+	volatile uint32_t uc_seq;	// Bumped by every signal
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0 }
+
+int	uthread_create(uthread_t *t, void *(*fn)(void *), void *arg);
+int	uthread_join(uthread_t t, void **retval_store);
+void	uthread_exit(void *retval) __attribute__((noreturn));
+uthread_t uthread_self(void);
+
+void	umutex_init(struct Umutex *m);
+void	umutex_lock(struct Umutex *m);
+bool	umutex_trylock(struct Umutex *m);
+void	umutex_unlock(struct Umutex *m);
+
+void	ucond_init(struct Ucond *c);
+void	ucond_wait(struct Ucond *c, struct Umutex *m);
+void	ucond_signal(struct Ucond *c);
+void	ucond_broadcast(struct Ucond *c);
+
+#endif	// !JOS_INC_UTHREAD_H
@@ -293,4 +293,14 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Index of the least significant set bit of val, which must not be 0.
+static inline uint32_t
+bsf(uint32_t val)
+{
+	uint32_t index;
+
+	asm("bsfl %1, %0" : "=r" (index) : "rm" (val) : "cc");
+	return index;
+}
+
 #endif /* !JOS_INC_X86_H */
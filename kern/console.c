@@ -6,6 +6,7 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -385,6 +386,13 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// Protects the input buffer and serializes output to the devices.
+static struct spinlock cons_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "cons_lock"
+#endif
+};
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
@@ -395,9 +403,11 @@ cons_intr(int (*proc)(void))
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
+		spin_lock(&cons_lock);
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		spin_unlock(&cons_lock);
 	}
 }
 
@@ -414,13 +424,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
@@ -448,7 +460,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
+	spin_lock(&cons_lock);
 	cons_putc(c);
+	spin_unlock(&cons_lock);
 }
 
 int
@@ -14,7 +14,6 @@
 enum {
 	CPU_UNUSED = 0,
 	CPU_STARTED,
-	CPU_HALTED,
 };
 
 // Per-CPU state
@@ -42,5 +41,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_periodic(void);
+void lapic_timer_oneshot(uint32_t usec);
 
 #endif
@@ -3,6 +3,14 @@
 #include <kern/pci.h>
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+// Protects the rings and the TDT/RDT registers.
+static struct spinlock e1000_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "e1000_lock"
+#endif
+};
 
 // the location of the virtual memory mapping for the E1000's BAR 0
 volatile uint32_t *attached_e1000;
@@ -10,12 +18,16 @@ volatile uint32_t *attached_e1000;
 // Allocate a region of memory for the transmit descriptor list.
 // Software should insure this memory is aligned on a paragraph (16-byte) boundary.
 struct tx_desc tx_ring[NTXDESC] __attribute__ ((aligned (16)));
-char tx_desc_buffers[NTXDESC][TPACK_MAX_SIZE];
+// Packet buffers come from page_alloc_order, so each one is physically
+// contiguous no matter where it falls within the block.
+#define TX_BUFFERS_ORDER 4	// 16 pages >= NTXDESC * TPACK_MAX_SIZE
+char (*tx_desc_buffers)[TPACK_MAX_SIZE];
 
 // Allocate a region of memory for the receive descriptor list.
 // Software should insure this memory is aligned on a paragraph (16-byte) boundary.
 struct rx_desc rx_ring[NRXDESC] __attribute__ ((aligned (16)));
-char rx_desc_buffers[NTXDESC][RPACK_MAX_SIZE];
+#define RX_BUFFERS_ORDER 7	// 128 pages >= NRXDESC * RPACK_MAX_SIZE
+char (*rx_desc_buffers)[RPACK_MAX_SIZE];
 
 uint16_t mac_address[3];
 
@@ -59,6 +71,16 @@ void init_rx_ring();
 
 
 int pci_attach_82540em(struct pci_func *f) {
+	struct PageInfo *tx_pages, *rx_pages;
+
+	static_assert(NTXDESC * TPACK_MAX_SIZE <= PGSIZE << TX_BUFFERS_ORDER);
+	static_assert(NRXDESC * RPACK_MAX_SIZE <= PGSIZE << RX_BUFFERS_ORDER);
+	if (!(tx_pages = page_alloc_order(TX_BUFFERS_ORDER, ALLOC_ZERO))
+	    || !(rx_pages = page_alloc_order(RX_BUFFERS_ORDER, ALLOC_ZERO)))
+		panic("pci_attach_82540em: out of memory for packet buffers");
+	tx_desc_buffers = page2kva(tx_pages);
+	rx_desc_buffers = page2kva(rx_pages);
+
 	pci_func_enable(f);
 	attached_e1000 = mmio_map_region(f->reg_base[0], f->reg_size[0]);
 
@@ -132,7 +154,17 @@ void init_tx_ring() {
 	}
 }
 
+static int __send_data_at(void *addr, uint16_t len);
+static int __recv_data_at(void *addr, uint16_t len, struct recv_res *res);
+
 int send_data_at(void *addr, uint16_t len) {
+	spin_lock(&e1000_lock);
+	int r = __send_data_at(addr, len);
+	spin_unlock(&e1000_lock);
+	return r;
+}
+
+static int __send_data_at(void *addr, uint16_t len) {
 	if (addr == NULL || len == 0) {
 		return 0;
 	}
@@ -180,6 +212,13 @@ void init_rx_ring() {
 
 // return received length or error code
 int recv_data_at(void *addr, uint16_t len, struct recv_res *res) {
+	spin_lock(&e1000_lock);
+	int r = __recv_data_at(addr, len, res);
+	spin_unlock(&e1000_lock);
+	return r;
+}
+
+static int __recv_data_at(void *addr, uint16_t len, struct recv_res *res) {
 	if (addr == NULL || len == 0) {
 		return 0;
 	}
@@ -14,10 +14,24 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_table_lock = {	// Protects env_free_list
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "env_table_lock"
+#endif
+};
+
+// Per-environment locks, kept out of struct Env since user programs
+// see that through UENVS.  envs[i]'s lock protects its status, page
+// tables, IPC state and the rest of its fields.  See kern/spinlock.h
+// for the lock order.
+static struct spinlock env_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -108,6 +122,103 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Lock environment e.
+// Also carries out TLB shootdowns posted to this CPU, since whoever
+// held the lock may have changed the page tables of e, which this CPU
+// may be about to access in the kernel.
+//
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[ENVX(e - envs)]);
+	tlb_shootdown_poll();
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[ENVX(e - envs)]);
+}
+
+//
+// Lock e1 and e2, which may be the same environment, in the lock order.
+//
+void
+env_lock2(struct Env *e1, struct Env *e2)
+{
+	if (e1 == e2)
+		env_lock(e1);
+	else if (e1 < e2) {
+		env_lock(e1);
+		env_lock(e2);
+	} else {
+		env_lock(e2);
+		env_lock(e1);
+	}
+}
+
+void
+env_unlock2(struct Env *e1, struct Env *e2)
+{
+	env_unlock(e1);
+	if (e2 != e1)
+		env_unlock(e2);
+}
+
+//
+// Like envid2env, but returns with the environment locked.  Since it
+// may be freed and its slot reused before the lock is taken, the
+// envid is checked again under the lock.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	envid_t id;
+	int r;
+
+	while (1) {
+		if ((r = envid2env(envid, &e, checkperm)) < 0)
+			return r;
+		id = e->env_id;
+		env_lock(e);
+		if (e->env_id == id && e->env_status != ENV_FREE) {
+			*env_store = e;
+			return 0;
+		}
+		env_unlock(e);
+	}
+}
+
+//
+// The same for two environments, which are locked with env_lock2.
+//
+int
+envid2env_lock2(envid_t envid1, struct Env **env1_store,
+		envid_t envid2, struct Env **env2_store, bool checkperm)
+{
+	struct Env *e1, *e2;
+	envid_t id1, id2;
+	int r;
+
+	while (1) {
+		if ((r = envid2env(envid1, &e1, checkperm)) < 0
+		    || (r = envid2env(envid2, &e2, checkperm)) < 0)
+			return r;
+		id1 = e1->env_id;
+		id2 = e2->env_id;
+		env_lock2(e1, e2);
+		if (e1->env_id == id1 && e1->env_status != ENV_FREE
+		    && e2->env_id == id2 && e2->env_status != ENV_FREE) {
+			*env1_store = e1;
+			*env2_store = e2;
+			return 0;
+		}
+		env_unlock2(e1, e2);
+	}
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -122,7 +233,9 @@ env_init(void)
 	int i;
 	env_free_list = envs;
 	for (i = 0; i < NENV; i++) {
+		__spin_initlock(&env_locks[i], "env_lock");
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
 		envs[i].env_link = (i == NENV-1) ? NULL : &envs[i+1];
 		envs[i].env_id = 0;
 	}
@@ -218,12 +331,21 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if ((e = env_free_list) != NULL)
+		env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
+	if (e == NULL)
 		return -E_NO_FREE_ENV;
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -234,8 +356,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	// Not runnable until the caller has finished setting it up; a
+	// stale run queue entry for this slot may be picked meanwhile.
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = cpunum();
+	e->env_affinity = ENV_AFFINITY_ALL;
+	e->env_migrations = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -264,15 +391,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_cow_faults = 0;
+	e->env_cow_copies = 0;
+
+	// No syscall ring until it registers one.
+	e->env_ring = NULL;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
 	// Challenge: a fixed-priority scheduler
-	e->priority = 0;
+	// The run queues are indexed by class and priority, so these may
+	// only be written directly because env_free took e off its queue.
+	assert(e->env_rq_cpu < 0);
+	e->priority = ENV_PRIO_MIN;
+	e->env_sched_class = ENV_SCHED_FAIR;
+	e->env_runtime = 0;
+	e->env_vruntime = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -281,7 +417,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 // Challenge: a fixed-priority scheduler
 void env_set_priority(struct Env *e, int priority) {
-	e->priority = priority;
+	sched_set_priority(e, priority);
 }
 
 //
@@ -324,8 +460,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
-// This function is ONLY called during kernel initialization,
-// before running the first user-mode environment.
+// This function is ONLY called during kernel initialization.
 //
 // This function loads all loadable segments from the ELF binary image
 // into the environment's user memory, starting at the appropriate
@@ -389,7 +524,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	// NOTICE: because all `struct Env`s are stored in UENVS,
 	// so it's ok to use variable `e` even after switching
 	// from kernel address space to user address space
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_switch(e->env_pgdir);
 	// set up the processor flags for a user process.
 	e->env_tf.tf_eip = elfhdr->e_entry;
 
@@ -414,7 +549,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	region_alloc(e, (void *) (USTACKTOP - PGSIZE), PGSIZE);
 
 	// switch back to kernel address space
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
 }
 
 //
@@ -442,10 +577,18 @@ env_create(uint8_t *binary, enum EnvType type)
 	if (type == ENV_TYPE_FS) {
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
+
+	env_lock(e);
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+	env_unlock(e);
 }
 
 //
-// Frees env e and all memory it uses.
+// Frees env e and all memory it uses, then wakes anyone waiting for it
+// with a futex on its env_status (see wait() in lib/wait.c), and fails
+// the sends of envs blocked sending to it.
+// The caller must hold e's lock, which is released.
 //
 void
 env_free(struct Env *e)
@@ -453,24 +596,33 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	envid_t envid = e->env_id;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_switch(kern_pgdir);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// with a single TLB shootdown round at the end
 	static_assert(UTOP % PTSIZE == 0);
+	tlb_batch_begin(e->env_pgdir);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a superpage has no page table to free
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -486,19 +638,33 @@ env_free(struct Env *e)
 		page_decref(pa2page(pa));
 	}
 
+	tlb_batch_end();
+
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	sched_dequeue(e);
+	timer_cancel(e);
+	futex_cancel(e);
+	ipc_queue_remove(e);
 	e->env_status = ENV_FREE;
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
+	env_unlock(e);
+
+	// Not before e is unlocked: waking takes the waiters' locks
+	futex_wake(PADDR(&e->env_status), NENV);
+	ipc_queue_flush(e, envid);
 }
 
 //
 // Frees environment e.
+// The caller must hold e's lock, which is released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -507,9 +673,11 @@ env_destroy(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	// it traps to the kernel, or when that CPU switches away from it.
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING)
+	    && curenv != e) {
 		e->env_status = ENV_DYING;
+		env_unlock(e);
 		return;
 	}
 
@@ -521,6 +689,72 @@ env_destroy(struct Env *e)
 	}
 }
 
+//
+// Give up environment e, which this CPU has just stopped running: put
+// it back on a run queue if it is still ENV_RUNNING, or free it if it
+// was killed meanwhile.
+//
+void
+env_put(struct Env *e)
+{
+	env_lock(e);
+	if (e->env_status == ENV_RUNNING) {
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	} else if (e->env_status == ENV_DYING) {
+		env_free(e);
+		return;
+	}
+	env_unlock(e);
+}
+
+//
+// Mark curenv e ENV_NOT_RUNNABLE, so that it runs again only once
+// something wakes it.  The caller holds e's lock, and 'other''s as
+// well unless it is NULL.  If another CPU killed e since it trapped
+// in, nothing would ever free it, so free it now (letting go of
+// 'other' first) and run something else instead of returning.
+//
+void
+env_block(struct Env *e, struct Env *other)
+{
+	assert(e == curenv);
+	if (e->env_status == ENV_DYING) {
+		if (other && other != e)
+			env_unlock(other);
+		env_free(e);
+		curenv = NULL;
+		sched_yield();
+	}
+	e->env_status = ENV_NOT_RUNNABLE;
+}
+
+
+//
+// Print every environment that is in use, with where it runs.
+//
+void
+env_stat_print(void)
+{
+	static const char *status_names[] = {
+		[ENV_FREE] = "free",
+		[ENV_DYING] = "dying",
+		[ENV_RUNNABLE] = "runnable",
+		[ENV_RUNNING] = "running",
+		[ENV_NOT_RUNNABLE] = "blocked",
+	};
+	struct Env *e;
+
+	cprintf("env       status    cpu      runs  migrations  affinity  cow faults  cow copies\n");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x  %-8s  %3d  %8d  %10d  %08x  %10d  %10d\n",
+			e->env_id, status_names[e->env_status], e->env_cpunum,
+			e->env_runs, e->env_migrations, e->env_affinity,
+			e->env_cow_faults, e->env_cow_copies);
+	}
+}
 
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
@@ -571,14 +805,35 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
-		curenv->env_status = ENV_RUNNABLE;
+	struct Env *prev;
+	bool switched = (e != curenv);
+
+	if (switched) {
+		// e was picked off a run queue without its lock, so
+		// another CPU may have run or killed it since.
+		env_lock(e);
+		if (e->env_status != ENV_RUNNABLE) {
+			env_unlock(e);
+			sched_yield();
+		}
+		e->env_status = ENV_RUNNING;
+		if (e->env_runs++ > 0 && e->env_cpunum != cpunum())
+			e->env_migrations++;
+		e->env_cpunum = cpunum();
+		sched_dequeue(e);
+		env_unlock(e);
+
+		// Only once e's address space is loaded may another
+		// CPU pick up the previous env and free it.
+		prev = curenv;
+		curenv = e;
+		pgdir_switch(e->env_pgdir);
+		if (prev)
+			env_put(prev);
 	}
 
-	curenv = e;
-	curenv->env_status = ENV_RUNNING;
-	curenv->env_runs++;
-	unlock_kernel();
-	lcr3(PADDR(curenv->env_pgdir));
+	sched_timer_arm(switched);
+	tlb_user_enter();
+	curenv->env_exec_start = read_tsc();
 	env_pop_tf(&curenv->env_tf);
 }
@@ -16,10 +16,20 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_put(struct Env *e);
+void	env_block(struct Env *e, struct Env *other);
+void	env_stat_print(void);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock2(struct Env *e1, struct Env *e2);
+void	env_unlock2(struct Env *e1, struct Env *e2);
 // Challenge: a fixed-priority scheduler that
 void    env_set_priority(struct Env *e, int priority);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock2(envid_t envid1, struct Env **env1_store,
+			envid_t envid2, struct Env **env2_store, bool checkperm);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
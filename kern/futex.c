@@ -0,0 +1,185 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+
+// Futexes: sleep until another env changes a word of shared memory.
+//
+// sys_futex_wait blocks the caller as long as the 32-bit word at a
+// user address holds an expected value; sys_futex_wake wakes envs
+// blocked on a word.  Waiters are keyed by the physical address of the
+// word, so envs sharing a page through PTE_SHARE mappings at different
+// virtual addresses find each other, and the kernel can wake waiters
+// on its own memory, such as the env_status fields user space sees
+// through UENVS.
+//
+// Waiters are kept in a hash table of FUTEX_HASH buckets.  A bucket's
+// lock protects its chain and the env_futex_* fields of the envs on
+// it; env_futex is only set or cleared with the env's lock held as
+// well.
+
+#define FUTEX_HASH	64
+
+// Envs woken per pass of futex_wake, which wakes them after dropping
+// the bucket lock since env locks come first in the lock order.
+#define WAKE_BATCH	16
+
+struct FutexBucket {
+	struct spinlock fb_lock;
+	struct Env *fb_head;
+} __attribute__((aligned(64)));
+
+static struct FutexBucket futex_table[FUTEX_HASH];
+
+static struct FutexBucket *
+futex_bucket(physaddr_t pa)
+{
+	return &futex_table[((pa >> 2) * 2654435761U) >> 26];
+}
+
+void
+futex_init(void)
+{
+	int i;
+
+	static_assert(FUTEX_HASH == 64);
+	for (i = 0; i < FUTEX_HASH; i++)
+		__spin_initlock(&futex_table[i].fb_lock, "futex_lock");
+}
+
+// Translate the user address va in e's address space to the physical
+// address of the word there.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not 4-byte aligned.
+//	-E_FAULT if e may not read va.
+// The caller must hold e's lock.
+int
+futex_key(struct Env *e, uintptr_t va, physaddr_t *pa)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if (va & 3)
+		return -E_INVAL;
+	if (user_mem_check(e, (void *) va, sizeof(uint32_t), PTE_U) < 0)
+		return -E_FAULT;
+	pp = page_lookup(e->env_pgdir, (void *) va, &pte);
+	assert(pp);
+	*pa = page2pa(pp) + (*pte & PTE_PS ? va & (PTSIZE - 1) : PGOFF(va));
+	return 0;
+}
+
+static void
+bucket_remove(struct Env *e)
+{
+	*e->env_futex_pprev = e->env_futex_next;
+	if (e->env_futex_next)
+		e->env_futex_next->env_futex_pprev = e->env_futex_pprev;
+	e->env_futex_next = NULL;
+	e->env_futex_pprev = NULL;
+}
+
+// If the word at va still holds 'expected', block e on it as
+// ENV_NOT_RUNNABLE until futex_wake, or until 'usec' microseconds
+// pass if usec is not 0, in which case the wait returns -E_TIMEOUT.
+// The value is checked with the bucket locked, so a waker that changes
+// the word and then calls futex_wake cannot be missed.
+// Returns 0 if e is now blocked, < 0 on error.  Errors are:
+//	-E_AGAIN if the word does not hold 'expected'.
+//	Any error from futex_key.
+// e must be curenv, and the caller must hold e's lock.  Does not
+// return if e has been killed (see env_block).
+int
+futex_wait(struct Env *e, uintptr_t va, uint32_t expected, uint32_t usec)
+{
+	struct FutexBucket *fb;
+	physaddr_t pa;
+	int r;
+
+	assert(e == curenv);
+	if ((r = futex_key(e, va, &pa)) < 0)
+		return r;
+
+	fb = futex_bucket(pa);
+	spin_lock(&fb->fb_lock);
+	if (*(volatile uint32_t *) va != expected) {
+		spin_unlock(&fb->fb_lock);
+		return -E_AGAIN;
+	}
+	e->env_futex = pa;
+	e->env_futex_next = fb->fb_head;
+	if (fb->fb_head)
+		fb->fb_head->env_futex_pprev = &e->env_futex_next;
+	fb->fb_head = e;
+	e->env_futex_pprev = &fb->fb_head;
+	spin_unlock(&fb->fb_lock);
+
+	e->env_tf.tf_regs.reg_eax = 0;
+	env_block(e, NULL);
+	if (usec)
+		timer_add(e, time_usec() + usec);
+	return 0;
+}
+
+// Wake up to n envs waiting on the word at physical address pa.
+// Returns the number of envs woken.
+int
+futex_wake(physaddr_t pa, int n)
+{
+	struct FutexBucket *fb = futex_bucket(pa);
+	struct Env *woken[WAKE_BATCH], *e, *next;
+	int i, k, nwoken = 0;
+
+	do {
+		k = 0;
+		spin_lock(&fb->fb_lock);
+		for (e = fb->fb_head; e && k < MIN(n - nwoken, WAKE_BATCH); e = next) {
+			next = e->env_futex_next;
+			if (e->env_futex == pa) {
+				bucket_remove(e);
+				woken[k++] = e;
+			}
+		}
+		spin_unlock(&fb->fb_lock);
+
+		for (i = 0; i < k; i++) {
+			e = woken[i];
+			env_lock(e);
+			// Unless the wait timed out or was cancelled
+			// since we took e off the bucket
+			if (e->env_futex == pa && !e->env_futex_pprev
+			    && e->env_status == ENV_NOT_RUNNABLE) {
+				e->env_futex = 0;
+				timer_cancel(e);
+				e->env_status = ENV_RUNNABLE;
+				sched_enqueue(e);
+				nwoken++;
+			}
+			env_unlock(e);
+		}
+	} while (k == WAKE_BATCH && nwoken < n);
+	return nwoken;
+}
+
+// Stop e waiting on a futex, if it is.  Leaves e's status alone.
+// The caller must hold e's lock.
+void
+futex_cancel(struct Env *e)
+{
+	struct FutexBucket *fb;
+
+	if (!e->env_futex)
+		return;
+	fb = futex_bucket(e->env_futex);
+	spin_lock(&fb->fb_lock);
+	if (e->env_futex_pprev)
+		bucket_remove(e);
+	spin_unlock(&fb->fb_lock);
+	e->env_futex = 0;
+}
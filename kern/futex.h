@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void futex_init(void);
+int futex_key(struct Env *e, uintptr_t va, physaddr_t *pa);
+int futex_wait(struct Env *e, uintptr_t va, uint32_t expected, uint32_t usec);
+int futex_wake(physaddr_t pa, int n);
+void futex_cancel(struct Env *e);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -13,6 +13,9 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 #include <kern/pci.h>
 
 static void boot_aps(void);
@@ -41,6 +44,7 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -52,13 +56,13 @@ i386_init(void)
 
 	// Lab 6 hardware initialization functions
 	time_init();
+	timer_init();
+	futex_init();
+	ipc_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-
-	// Starting non-boot CPUs
-	lock_kernel();
+	// Starting non-boot CPUs.  They may start running envs as soon
+	// as the ENV_CREATEs below put them on the run queues.
 	boot_aps();
 
 	// Start fs.
@@ -121,7 +125,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
+	lcr4(rcr4() | CR4_PSE);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -130,11 +135,7 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.
 	sched_yield();
 }
 
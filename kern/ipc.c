@@ -0,0 +1,157 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/ipc.h>
+
+// Sender queues for blocking IPC.
+//
+// An env that sys_ipc_send's to an env not blocked in sys_ipc_recv is
+// queued on the receiver and blocks as ENV_NOT_RUNNABLE, with its
+// message in its env_ipc_send_* fields, until the receiver calls
+// sys_ipc_recv and takes the message.  Senders are queued by priority,
+// first come first served among equal priorities.
+//
+// The queue on envs[i] is protected by ipc_locks[i], which belongs to
+// the slot rather than the env, so a sender can always find the lock
+// from the envid it is sending to.  env_ipc_send_to is only set or
+// cleared with the sender's lock held, and stays set while the sender
+// is queued.
+
+// Senders woken per pass of ipc_queue_flush, which wakes them after
+// dropping the queue lock since env locks come first in the lock order.
+#define WAKE_BATCH	16
+
+static struct spinlock ipc_locks[NENV];
+
+void
+ipc_init(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		__spin_initlock(&ipc_locks[i], "ipc_lock");
+}
+
+// Queue 'from', which is about to block sending to 'to'.
+// The caller must hold both envs' locks.
+void
+ipc_queue_add(struct Env *to, struct Env *from)
+{
+	struct spinlock *lk = &ipc_locks[ENVX(to->env_id)];
+	struct Env **pp;
+
+	from->env_ipc_send_to = to->env_id;
+	spin_lock(lk);
+	for (pp = &to->env_ipc_senders; *pp; pp = &(*pp)->env_ipc_send_next)
+		if ((*pp)->priority < from->priority)
+			break;
+	from->env_ipc_send_next = *pp;
+	if (*pp)
+		(*pp)->env_ipc_send_pprev = &from->env_ipc_send_next;
+	*pp = from;
+	from->env_ipc_send_pprev = pp;
+	spin_unlock(lk);
+}
+
+// The first env queued to send to 'to', or NULL.  By the time the
+// caller locks that env, it may have left the queue.
+// The caller must hold to's lock.
+struct Env *
+ipc_queue_first(struct Env *to)
+{
+	struct spinlock *lk = &ipc_locks[ENVX(to->env_id)];
+	struct Env *e;
+
+	spin_lock(lk);
+	e = to->env_ipc_senders;
+	spin_unlock(lk);
+	return e;
+}
+
+static void
+queue_unlink(struct Env *e)
+{
+	*e->env_ipc_send_pprev = e->env_ipc_send_next;
+	if (e->env_ipc_send_next)
+		e->env_ipc_send_next->env_ipc_send_pprev = e->env_ipc_send_pprev;
+	e->env_ipc_send_next = NULL;
+	e->env_ipc_send_pprev = NULL;
+}
+
+// Take 'from' off the queue of the env it is blocked sending to, if
+// any, and clear its env_ipc_send_to.  Leaves its status alone.
+// The caller must hold from's lock.
+void
+ipc_queue_remove(struct Env *from)
+{
+	struct spinlock *lk;
+
+	if (!from->env_ipc_send_to)
+		return;
+	lk = &ipc_locks[ENVX(from->env_ipc_send_to)];
+	spin_lock(lk);
+	if (from->env_ipc_send_pprev)
+		queue_unlink(from);
+	spin_unlock(lk);
+	from->env_ipc_send_to = 0;
+}
+
+// Fail the IPC of all envs still queued on 'to', which has been freed,
+// and of envs blocked in sys_ipc_call waiting for its reply: they
+// return -E_BAD_ENV.  'to_id' is the envid 'to' had, since its slot may
+// have been reused already.
+// The caller must not hold to's lock.
+void
+ipc_queue_flush(struct Env *to, envid_t to_id)
+{
+	struct spinlock *lk = &ipc_locks[ENVX(to_id)];
+	struct Env *woken[WAKE_BATCH], *e, *next;
+	int i, n;
+
+	do {
+		n = 0;
+		spin_lock(lk);
+		for (e = to->env_ipc_senders; e && n < WAKE_BATCH; e = next) {
+			next = e->env_ipc_send_next;
+			if (e->env_ipc_send_to == to_id) {
+				queue_unlink(e);
+				woken[n++] = e;
+			}
+		}
+		spin_unlock(lk);
+
+		for (i = 0; i < n; i++) {
+			e = woken[i];
+			env_lock(e);
+			if (e->env_ipc_send_to == to_id && !e->env_ipc_send_pprev
+			    && e->env_status == ENV_NOT_RUNNABLE) {
+				e->env_ipc_send_to = 0;
+				e->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+				e->env_status = ENV_RUNNABLE;
+				sched_enqueue(e);
+			}
+			env_unlock(e);
+		}
+	} while (n == WAKE_BATCH);
+
+	// Callers are not queued anywhere once their message is taken,
+	// so look through all envs.  A caller that got its reply is no
+	// longer receiving; one that has yet to block cannot, since 'to'
+	// is no longer there to call.
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (!e->env_ipc_recving || e->env_ipc_recv_from != to_id)
+			continue;
+		env_lock(e);
+		if (e->env_ipc_recving && e->env_ipc_recv_from == to_id
+		    && e->env_status == ENV_NOT_RUNNABLE) {
+			e->env_ipc_recving = 0;
+			e->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			e->env_status = ENV_RUNNABLE;
+			sched_enqueue(e);
+		}
+		env_unlock(e);
+	}
+}
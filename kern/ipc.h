@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void ipc_init(void);
+void ipc_queue_add(struct Env *to, struct Env *from);
+struct Env *ipc_queue_first(struct Env *to);
+void ipc_queue_remove(struct Env *from);
+void ipc_queue_flush(struct Env *to, envid_t to_id);
+
+#endif	// !JOS_KERN_IPC_H
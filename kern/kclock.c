@@ -20,3 +20,23 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+/* Start PIT channel 2 counting down 'usec' microseconds (at most 54925),
+ * with the speaker off.  Used to calibrate the TSC and LAPIC timer. */
+void
+pit_oneshot_start(unsigned usec)
+{
+	unsigned count = (uint64_t) PIT_HZ * usec / 1000000;
+
+	outb(IO_PPI, (inb(IO_PPI) & ~PPI_SPKR) | PPI_GATE2);
+	outb(PIT_CTL, PIT_SEL_CH2 | PIT_RW_16BIT | PIT_MODE_ONESHOT);
+	outb(PIT_CH2, count & 0xff);
+	outb(PIT_CH2, count >> 8);
+}
+
+/* Whether the count down started by pit_oneshot_start has finished. */
+int
+pit_oneshot_done(void)
+{
+	return inb(IO_PPI) & PPI_OUT2;
+}
@@ -26,7 +26,23 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+/* 8253/8254 programmable interval timer (PIT) */
+#define	IO_PIT		0x040		/* PIT ports */
+#define	PIT_HZ		1193182		/* PIT input clock frequency */
+#define	PIT_CTL		(IO_PIT + 3)	/* Control word */
+#define	PIT_CH2		(IO_PIT + 2)	/* Channel 2 counter */
+#define	PIT_SEL_CH2	0x80		/* Select channel 2 */
+#define	PIT_RW_16BIT	0x30		/* Low byte, then high byte */
+#define	PIT_MODE_ONESHOT 0x00		/* Mode 0: out goes high at zero */
+#define	IO_PPI		0x061		/* Keyboard controller port B */
+#define	PPI_GATE2	0x01		/* Channel 2 gate */
+#define	PPI_SPKR	0x02		/* Speaker enable */
+#define	PPI_OUT2	0x20		/* Channel 2 output */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
+void pit_oneshot_start(unsigned usec);
+int pit_oneshot_done(void);
+
 #endif	// !JOS_KERN_KCLOCK_H
@@ -0,0 +1,469 @@
+// Slab allocator for kernel objects.
+//
+// A kmem_cache hands out objects of one size.  The objects live in
+// slabs: single pages, each starting with a struct kmem_slab header
+// followed by as many objects as fit, free ones linked through their
+// first word.  Slab pages are marked PP_SLAB, so kfree can tell them
+// from the multi-page blocks kmalloc uses for large sizes.
+//
+// In front of the slabs, every CPU keeps a small stack of free objects
+// per cache, so most allocations and frees take no lock.  They only go
+// to the slabs, under the cache's lock, to move KMEM_CPU_BATCH objects
+// at a time.
+
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MAX_CACHES	32	// Caches kmem_cache_create can make
+#define KMEM_NAMELEN	16
+#define KMEM_CPU_MAX	16	// Objects each CPU keeps per cache
+#define KMEM_CPU_BATCH	8	// Objects moved per refill or drain
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	// On the cache's partial or full list
+	struct kmem_slab **ks_pprev;
+	void *ks_free;			// Free objects in this slab
+	int ks_inuse;			// Objects handed out
+};
+
+struct kmem_cpu_cache {
+	int kcc_count;			// Objects in kcc_objs
+	void *kcc_objs[KMEM_CPU_MAX];
+
+	// Statistics
+	uint32_t kcc_allocs;
+	uint32_t kcc_frees;
+};
+
+struct kmem_cache {
+	char kc_name[KMEM_NAMELEN];
+	size_t kc_size;			// Object size; 0 if the slot is unused
+	size_t kc_align;
+	size_t kc_offset;		// Offset of the first object in a slab
+	int kc_perslab;			// Objects per slab
+
+	struct spinlock kc_lock;	// Protects the slab lists and counts
+	struct kmem_slab *kc_partial;	// Slabs with free objects
+	struct kmem_slab *kc_full;	// Slabs without
+	int kc_nslabs;
+	int kc_nempty;			// Slabs with no objects handed out
+	int kc_inuse;			// Objects handed out of slabs
+
+	struct kmem_cpu_cache kc_cpu[NCPU];
+};
+
+// Caches are only published, and their slots only reused, under
+// kmem_lock.
+static struct kmem_cache kmem_caches[KMEM_MAX_CACHES];
+static int kmem_ncaches;		// Slots ever used
+static struct spinlock kmem_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "kmem_lock"
+#endif
+};
+
+// kmalloc size classes: 64, 128, ..., KMALLOC_MAX bytes.  Larger
+// requests get whole pages from page_alloc_order.
+#define KMALLOC_MIN_SHIFT	6
+#define KMALLOC_MAX_SHIFT	11
+#define KMALLOC_MAX		(1 << KMALLOC_MAX_SHIFT)
+
+static struct kmem_cache *kmalloc_caches[KMALLOC_MAX_SHIFT + 1];
+
+static void check_kmem(void);
+
+// Create the kmalloc caches.
+void
+kmem_init(void)
+{
+	static char names[KMALLOC_MAX_SHIFT + 1][KMEM_NAMELEN];
+	int i;
+
+	for (i = KMALLOC_MIN_SHIFT; i <= KMALLOC_MAX_SHIFT; i++) {
+		snprintf(names[i], KMEM_NAMELEN, "kmalloc-%d", 1 << i);
+		if (!(kmalloc_caches[i] = kmem_cache_create(names[i], 1 << i, 0)))
+			panic("kmem_init: cannot create %s", names[i]);
+	}
+
+	check_kmem();
+}
+
+//
+// Create a cache of 'size'-byte objects aligned to 'align' bytes
+// (a power of 2; 0 means CACHELINE).
+// Returns NULL if the object does not fit in a slab or there are
+// no cache slots left.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	struct kmem_cache *cp;
+	int i;
+
+	if (align == 0)
+		align = CACHELINE;
+	if (align < sizeof(void *) || (align & (align - 1)) != 0)
+		return NULL;
+	size = ROUNDUP(MAX(size, sizeof(void *)), align);
+	if (ROUNDUP(sizeof(struct kmem_slab), align) + size > PGSIZE)
+		return NULL;
+
+	spin_lock(&kmem_lock);
+	for (i = 0; i < kmem_ncaches && kmem_caches[i].kc_size != 0; i++)
+		/* do nothing */;
+	if (i == KMEM_MAX_CACHES) {
+		spin_unlock(&kmem_lock);
+		return NULL;
+	}
+
+	// Fill the slot in before kmem_stat_print can see it
+	cp = &kmem_caches[i];
+	memset(cp, 0, sizeof(*cp));
+	strncpy(cp->kc_name, name, KMEM_NAMELEN - 1);
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	cp->kc_lock.name = cp->kc_name;
+#endif
+	cp->kc_align = align;
+	cp->kc_offset = ROUNDUP(sizeof(struct kmem_slab), align);
+	cp->kc_perslab = (PGSIZE - cp->kc_offset) / size;
+	cp->kc_size = size;
+	if (i == kmem_ncaches)
+		kmem_ncaches++;
+	spin_unlock(&kmem_lock);
+	return cp;
+}
+
+//
+// Slab list helpers.  The caller must hold cp->kc_lock.
+//
+
+static void
+slab_link(struct kmem_slab **head, struct kmem_slab *sp)
+{
+	sp->ks_next = *head;
+	if (sp->ks_next)
+		sp->ks_next->ks_pprev = &sp->ks_next;
+	sp->ks_pprev = head;
+	*head = sp;
+}
+
+static void
+slab_unlink(struct kmem_slab *sp)
+{
+	*sp->ks_pprev = sp->ks_next;
+	if (sp->ks_next)
+		sp->ks_next->ks_pprev = sp->ks_pprev;
+}
+
+// Add a fresh slab to cp's partial list.
+static struct kmem_slab *
+slab_grow(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sp;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_ref++;
+	pp->pp_flags |= PP_SLAB;
+
+	sp = page2kva(pp);
+	sp->ks_cache = cp;
+	sp->ks_inuse = 0;
+	sp->ks_free = NULL;
+	for (i = cp->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *) sp + cp->kc_offset + i * cp->kc_size;
+		*(void **) obj = sp->ks_free;
+		sp->ks_free = obj;
+	}
+
+	slab_link(&cp->kc_partial, sp);
+	cp->kc_nslabs++;
+	cp->kc_nempty++;
+	return sp;
+}
+
+// Give an unused slab's page back.
+static void
+slab_destroy(struct kmem_cache *cp, struct kmem_slab *sp)
+{
+	struct PageInfo *pp = pa2page(PADDR(sp));
+
+	slab_unlink(sp);
+	cp->kc_nslabs--;
+	cp->kc_nempty--;
+	pp->pp_flags &= ~PP_SLAB;
+	page_decref(pp);
+}
+
+// Take an object from cp's slabs, growing the cache if needed.
+static void *
+slab_alloc(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	void *obj;
+
+	if (!(sp = cp->kc_partial) && !(sp = slab_grow(cp)))
+		return NULL;
+
+	obj = sp->ks_free;
+	sp->ks_free = *(void **) obj;
+	if (sp->ks_inuse++ == 0)
+		cp->kc_nempty--;
+	if (sp->ks_free == NULL) {
+		slab_unlink(sp);
+		slab_link(&cp->kc_full, sp);
+	}
+	cp->kc_inuse++;
+	return obj;
+}
+
+// Return an object to its slab.  Keeps at most one empty slab around.
+static void
+slab_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sp = ROUNDDOWN(obj, PGSIZE);
+
+	if (sp->ks_cache != cp)
+		panic("kmem_cache_free: %p does not belong to cache %s",
+		      obj, cp->kc_name);
+
+	if (sp->ks_free == NULL) {
+		slab_unlink(sp);
+		slab_link(&cp->kc_partial, sp);
+	}
+	*(void **) obj = sp->ks_free;
+	sp->ks_free = obj;
+	cp->kc_inuse--;
+	if (--sp->ks_inuse == 0 && ++cp->kc_nempty > 1)
+		slab_destroy(cp, sp);
+}
+
+//
+// Destroy cp, giving its slabs back.  Every object allocated from it
+// must have been freed, and no CPU may still be using it.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc;
+	int c;
+
+	spin_lock(&cp->kc_lock);
+	for (c = 0; c < NCPU; c++) {
+		cc = &cp->kc_cpu[c];
+		while (cc->kcc_count > 0)
+			slab_free(cp, cc->kcc_objs[--cc->kcc_count]);
+	}
+	if (cp->kc_inuse != 0)
+		panic("kmem_cache_destroy: %d objects of cache %s still in use",
+		      cp->kc_inuse, cp->kc_name);
+	while (cp->kc_partial)
+		slab_destroy(cp, cp->kc_partial);
+	assert(cp->kc_full == NULL && cp->kc_nslabs == 0);
+	spin_unlock(&cp->kc_lock);
+
+	spin_lock(&kmem_lock);
+	cp->kc_size = 0;
+	spin_unlock(&kmem_lock);
+}
+
+//
+// Allocate an object from cp.  Its contents are undefined.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+	void *obj;
+
+	if (cc->kcc_count == 0) {
+		spin_lock(&cp->kc_lock);
+		while (cc->kcc_count < KMEM_CPU_BATCH
+		       && (obj = slab_alloc(cp)) != NULL)
+			cc->kcc_objs[cc->kcc_count++] = obj;
+		spin_unlock(&cp->kc_lock);
+		if (cc->kcc_count == 0)
+			return NULL;
+	}
+
+	cc->kcc_allocs++;
+	return cc->kcc_objs[--cc->kcc_count];
+}
+
+//
+// Return an object allocated from cp.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+
+	if (cc->kcc_count == KMEM_CPU_MAX) {
+		spin_lock(&cp->kc_lock);
+		while (cc->kcc_count > KMEM_CPU_MAX - KMEM_CPU_BATCH)
+			slab_free(cp, cc->kcc_objs[--cc->kcc_count]);
+		spin_unlock(&cp->kc_lock);
+	}
+
+	cc->kcc_frees++;
+	cc->kcc_objs[cc->kcc_count++] = obj;
+}
+
+//
+// Allocate 'size' bytes, aligned to at least CACHELINE bytes.
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size)
+{
+	struct PageInfo *pp;
+	int shift, order;
+
+	if (size <= KMALLOC_MAX) {
+		for (shift = KMALLOC_MIN_SHIFT; (1 << shift) < size; shift++)
+			/* do nothing */;
+		return kmem_cache_alloc(kmalloc_caches[shift]);
+	}
+
+	for (order = 0; (PGSIZE << order) < size; order++)
+		/* do nothing */;
+	if (!(pp = page_alloc_order(order, 0)))
+		return NULL;
+	pp->pp_ref++;
+	return page2kva(pp);
+}
+
+//
+// Free memory returned by kmalloc.
+//
+void
+kfree(void *ptr)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sp;
+
+	if (ptr == NULL)
+		return;
+
+	pp = pa2page(PADDR(ptr));
+	if (pp->pp_flags & PP_SLAB) {
+		sp = ROUNDDOWN(ptr, PGSIZE);
+		kmem_cache_free(sp->ks_cache, ptr);
+	} else {
+		page_decref(pp);
+	}
+}
+
+//
+// Print every cache's utilization.
+// Used by the 'kmemstat' monitor command.
+//
+void
+kmem_stat_print(void)
+{
+	struct kmem_cache *cp;
+	struct kmem_cpu_cache *cc;
+	uint32_t allocs, frees;
+	int i, c, cached, capacity;
+
+	cprintf("%-16s %6s %6s %8s %6s %6s %9s %9s\n",
+		"cache", "size", "slabs", "in use", "util", "cpu", "allocs", "frees");
+	for (i = 0; i < kmem_ncaches; i++) {
+		cp = &kmem_caches[i];
+		if (cp->kc_size == 0)
+			continue;
+		allocs = frees = cached = 0;
+		for (c = 0; c < NCPU; c++) {
+			cc = &cp->kc_cpu[c];
+			allocs += cc->kcc_allocs;
+			frees += cc->kcc_frees;
+			cached += cc->kcc_count;
+		}
+		capacity = cp->kc_nslabs * cp->kc_perslab;
+		// Objects sitting in per-CPU caches are free, not in use
+		cprintf("%-16s %6d %6d %8d %5d%% %6d %9u %9u\n",
+			cp->kc_name, cp->kc_size, cp->kc_nslabs,
+			cp->kc_inuse - cached,
+			capacity ? (cp->kc_inuse - cached) * 100 / capacity : 0,
+			cached, allocs, frees);
+	}
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *cp, *small;
+	struct PageInfo *pp;
+	void *objs[300];
+	char *p;
+	int i, j, nslabs, ncaches;
+
+	assert((cp = kmem_cache_create("check", 100, 0)));
+	assert(cp->kc_size == 128);
+
+	// enough objects to need several slabs; all aligned and distinct
+	for (i = 0; i < 300; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		assert((uintptr_t) objs[i] % CACHELINE == 0);
+		assert(pa2page(PADDR(objs[i]))->pp_flags & PP_SLAB);
+		memset(objs[i], i, 100);
+	}
+	for (i = 0; i < 300; i++)
+		for (j = 0; j < 100; j++)
+			assert(((unsigned char *) objs[i])[j] == (i & 0xff));
+	nslabs = cp->kc_nslabs;
+	assert(nslabs >= 300 / cp->kc_perslab);
+
+	// freeing everything gives all but one slab back
+	for (i = 0; i < 300; i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->kc_nempty <= 1 && cp->kc_nslabs < nslabs);
+
+	// objects come back from the per-CPU cache first
+	assert(kmem_cache_alloc(cp) == objs[299]);
+	kmem_cache_free(cp, objs[299]);
+
+	// a cache with smaller alignment packs objects tighter
+	assert((small = kmem_cache_create("check-small", 8, 8)));
+	assert(small->kc_size == 8 && small->kc_perslab > 400);
+	assert(!kmem_cache_create("check-big", PGSIZE, 0));
+	kmem_cache_destroy(small);
+
+	// destroying a cache gives back its pages, even the ones the
+	// per-CPU caches still hold objects from, and frees its slot
+	pp = pa2page(PADDR(objs[299]));
+	assert(pp->pp_ref == 1);
+	ncaches = kmem_ncaches;
+	kmem_cache_destroy(cp);
+	assert(pp->pp_ref == 0 && !(pp->pp_flags & PP_SLAB));
+	assert(kmem_cache_create("check", 100, 0) == cp);
+	assert(kmem_ncaches == ncaches);
+	kmem_cache_destroy(cp);
+
+	// kmalloc picks the right size class, and big sizes use pages
+	assert((p = kmalloc(65)));
+	assert(((struct kmem_slab *) ROUNDDOWN(p, PGSIZE))->ks_cache->kc_size == 128);
+	kfree(p);
+	assert((p = kmalloc(3 * PGSIZE)));
+	assert(PGOFF(p) == 0 && !(pa2page(PADDR(p))->pp_flags & PP_SLAB));
+	assert(pa2page(PADDR(p))->pp_order == 2 && pa2page(PADDR(p))->pp_ref == 1);
+	kfree(p);
+	assert(pa2page(PADDR(p))->pp_ref == 0);
+
+	cprintf("check_kmem() succeeded!\n");
+}
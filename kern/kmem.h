@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Objects are aligned to this by default, so that objects used by
+// different CPUs never share a cache line.
+#define CACHELINE	64
+
+struct kmem_cache;
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+
+void *	kmalloc(size_t size);
+void	kfree(void *ptr);
+
+void	kmem_stat_print(void);
+
+#endif /* !JOS_KERN_KMEM_H */
@@ -9,6 +9,8 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -32,6 +34,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -42,9 +45,20 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// Timer counts in one timer tick (10 ms) if calibration is impossible
+#define TICK_COUNT	10000000
+
+// How long to calibrate the timer for
+#define CALIBRATE_USEC	20000
+
+static void lapic_timer_calibrate(void);
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts in one timer tick, measured by the boot CPU
+static uint32_t lapic_tick_count = TICK_COUNT;
+
 static void
 lapicw(int index, int value)
 {
@@ -67,11 +81,13 @@ lapic_init(void)
 
 	// The timer repeatedly counts down at bus frequency
 	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The boot CPU calibrates TICR against the PIT, so that a
+	// tick lasts TICK_USEC.
+	// The scheduler may switch it to one-shot mode later.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		lapic_timer_calibrate();
+	lapic_timer_periodic();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -111,6 +127,56 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Measure the frequencies of the timer and of the TSC against the PIT,
+// whose frequency is known.
+static void
+lapic_timer_calibrate(void)
+{
+	uint64_t start, cycles;
+	uint32_t counts;
+
+	lapicw(TIMER, MASKED | ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	pit_oneshot_start(CALIBRATE_USEC);
+	lapicw(TICR, 0xFFFFFFFF);
+	start = read_tsc();
+	while (!pit_oneshot_done())
+		;
+	cycles = read_tsc() - start;
+	counts = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_tick_count = (uint64_t) counts * TICK_USEC / CALIBRATE_USEC;
+	time_calibrate(cycles * 1000000 / CALIBRATE_USEC);
+	cprintf("LAPIC timer %u counts per tick, TSC %u kHz\n",
+		lapic_tick_count, (unsigned) (cycles * 1000 / CALIBRATE_USEC));
+}
+
+// Interrupt this CPU every timer tick.
+void
+lapic_timer_periodic(void)
+{
+	if (!lapic)
+		return;
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_tick_count);
+}
+
+// Interrupt this CPU once, 'usec' microseconds from now, or never
+// if usec is 0.  This replaces any earlier setting.
+void
+lapic_timer_oneshot(uint32_t usec)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	count = (uint64_t) usec * lapic_tick_count / TICK_USEC;
+	if (usec && count == 0)
+		count = 1;
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, MIN(count, 0xFFFFFFFF));
+}
+
 int
 cpunum(void)
 {
@@ -134,7 +200,6 @@ microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
 
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
@@ -180,3 +245,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an IPI to the CPU whose local APIC ID is apicid.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -6,13 +6,18 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/env.h>
 // Lab 2 challenge: finish `showmappings` function
 #include <kern/pmap.h>
+#include <kern/kmem.h>
 
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -32,6 +37,13 @@ static struct Command commands[] = {
 	{ "dumpva", "Display VA contents", mon_dumpva },
 	{ "continue", "Continue execution", mon_continue },
 	{ "single_step", "Execute one instruction", mon_single_step },
+	{ "pagestat", "Display page allocator statistics", mon_pagestat },
+	{ "tlbstat", "Display TLB shootdown statistics", mon_tlbstat },
+	{ "kmemstat", "Display kernel object cache utilization", mon_kmemstat },
+	{ "timeslice", "Display or set the time slice of a priority", mon_timeslice },
+	{ "lockstat", "Display or reset spinlock contention statistics", mon_lockstat },
+	{ "envs", "Display environments and the CPUs they run on", mon_envs },
+	{ "tickless", "Display or set whether the timer runs only when needed", mon_tickless },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -178,6 +190,86 @@ mon_single_step(int argc, char **argv, struct Trapframe *tf)
 	return -1;
 }
 
+int
+mon_pagestat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_stat_print();
+	return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+	tlb_stat_print();
+	return 0;
+}
+
+int
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_stat_print();
+	return 0;
+}
+
+int
+mon_timeslice(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 1) {
+		sched_slice_print();
+		return 0;
+	}
+	if (argc != 3) {
+		cprintf("Usage: timeslice [<priority> <ticks>]\n");
+		return -1;
+	}
+	if (sched_set_slice(strtol(argv[1], NULL, 10), strtol(argv[2], NULL, 10)) < 0) {
+		cprintf("timeslice: priority must be %d..%d, ticks at least 1\n",
+			ENV_PRIO_MIN, ENV_PRIO_MAX);
+		return -1;
+	}
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 1) {
+		lockstat_print();
+		return 0;
+	}
+	if (argc != 2 || strcmp(argv[1], "reset") != 0) {
+		cprintf("Usage: lockstat [reset]\n");
+		return -1;
+	}
+	lockstat_reset();
+	return 0;
+}
+
+int
+mon_envs(int argc, char **argv, struct Trapframe *tf)
+{
+	env_stat_print();
+	return 0;
+}
+
+int
+mon_tickless(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 1) {
+		cprintf("tickless %s\n", sched_tickless ? "on" : "off");
+		return 0;
+	}
+	if (argc != 2 || (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0)) {
+		cprintf("Usage: tickless [on|off]\n");
+		return -1;
+	}
+	sched_tickless = (strcmp(argv[1], "on") == 0);
+	// Idle CPUs may be sleeping with their timer stopped; have them
+	// set it up again.
+	lapic_ipi(IRQ_OFFSET + IRQ_RESCHED);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -19,5 +19,12 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_dumpva(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
 int mon_single_step(int argc, char **argv, struct Trapframe *tf);
+int mon_pagestat(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmemstat(int argc, char **argv, struct Trapframe *tf);
+int mon_timeslice(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_envs(int argc, char **argv, struct Trapframe *tf);
+int mon_tickless(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
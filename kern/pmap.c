@@ -7,9 +7,11 @@
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
+#include <kern/kmem.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,8 +20,162 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
-
+static struct PageInfo *page_free_list;	// Free list used while booting
+static size_t page_depot_count;		// Number of free pages in the depot
+static struct spinlock page_depot_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "page_depot_lock"
+#endif
+};
+
+// Buddy allocator.
+//
+// Once mem_init is done, the depot behind the per-CPU magazines is a
+// binary buddy allocator over pages[].  A free block of order k covers
+// 2^k pages starting at a page index that is a multiple of 2^k; its
+// first page is on buddy_free_area[k] and has PP_BUDDY set in pp_flags.
+// Freeing a block merges it with its buddy for as long as the buddy is
+// free and of the same order, so single pages returned by the
+// magazines coalesce back into large physically contiguous runs.
+static struct PageInfo *buddy_free_area[PAGE_MAX_ORDER + 1];
+static size_t buddy_nfree[PAGE_MAX_ORDER + 1];	// Free blocks per order
+
+// Per-CPU page magazines.
+//
+// Each CPU keeps a small stack of free pages (linked by pp_link, just
+// like page_free_list) in front of the depot.  page_alloc and page_free
+// only go to the depot when the local magazine runs empty or overflows,
+// and then move PAGE_MAG_BATCH pages in one go, so the depot lock is
+// taken once per batch instead of once per page.
+//
+// Pages sitting in another CPU's magazine are invisible to this CPU, so
+// up to NCPU * PAGE_MAG_SIZE free pages may be unavailable when the
+// depot runs dry.
+#define PAGE_MAG_SIZE	64	// Pages a magazine may hold
+#define PAGE_MAG_BATCH	32	// Pages moved per refill or drain
+
+struct PageMagazine {
+	struct PageInfo *pm_head;	// Free pages, linked by pp_link
+	int pm_count;			// Number of pages on pm_head
+
+	// Statistics
+	uint32_t pm_alloc_hit;		// page_alloc served locally
+	uint32_t pm_alloc_miss;		// page_alloc had to refill
+	uint32_t pm_free_hit;		// page_free absorbed locally
+	uint32_t pm_free_miss;		// page_free had to drain
+	uint32_t pm_depot_out;		// Pages taken from the depot
+	uint32_t pm_depot_in;		// Pages given back to the depot
+	uint32_t pm_zero_hit;		// ALLOC_ZERO served pre-zeroed
+	uint32_t pm_zero_miss;		// ALLOC_ZERO had to memset
+};
+
+static struct PageMagazine page_magazines[NCPU];
+
+// Pre-zeroed page pool.
+//
+// CPUs about to halt in sched_halt zero free pages ahead of time and
+// park them here (linked by pp_link), so that page_alloc(ALLOC_ZERO)
+// can usually skip the memset.  The pool is bounded so idle CPUs
+// don't sweep all of free memory, and it hands its pages out to
+// ordinary allocations once everything else has run dry.
+#define PAGE_ZERO_MAX	256	// Pages the pool may hold
+#define PAGE_ZERO_BATCH	16	// Pages zeroed per trip through sched_halt
+
+static struct PageInfo *page_zero_list;
+static size_t page_zero_count;		// Number of pages on page_zero_list
+static uint32_t page_zero_filled;	// Pages zeroed by idle CPUs so far
+static struct spinlock page_zero_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "page_zero_lock"
+#endif
+};
+
+// TLB shootdown.
+//
+// Each CPU records the page directory it has loaded (pgdir_switch) and
+// whether it is running user code.  tlb_invalidate flushes the local
+// TLB and posts the address to the mailbox of every other CPU that has
+// the same page directory loaded.  CPUs in user mode get an IPI, and
+// the sender waits until they have processed their mailbox.  CPUs in
+// the kernel are not waited for: they process the mailbox when they
+// next return to user mode or lock an environment (env_lock), before
+// they can touch user memory again.  So the sender never waits for a CPU
+// that has interrupts disabled.
+//
+// Between tlb_batch_begin and tlb_batch_end, tlb_invalidate only
+// collects addresses, and tlb_batch_end sends them all in one round.
+// If more than TLB_BATCH_MAX addresses pile up, in a batch or in a
+// mailbox, a full TLB flush (a CR3 reload) is done instead.
+//
+// A page that page_remove unmaps for the last time is freed only after
+// its invalidation is done, at tlb_batch_end inside a batch: until
+// then another CPU may still write to it through a stale TLB entry.
+#define TLB_BATCH_MAX	32
+#define TLB_FLUSH_ALL	(TLB_BATCH_MAX + 1)	// nva meaning "everything"
+
+struct TlbState {
+	pde_t *tlb_pgdir;		// Page directory loaded in CR3
+	volatile uint32_t tlb_in_user;	// Running user code
+
+	// Mailbox of addresses other CPUs want flushed
+	struct spinlock tlb_lock;
+	int tlb_nva;			// Entries in tlb_va, or TLB_FLUSH_ALL
+	uintptr_t tlb_va[TLB_BATCH_MAX];
+	volatile uint32_t tlb_req;	// Requests posted to the mailbox
+	volatile uint32_t tlb_done;	// Requests processed
+
+	// This CPU's open batch
+	int tlb_batch_depth;		// Nesting of tlb_batch_begin
+	pde_t *tlb_batch_pgdir;
+	int tlb_batch_nva;		// Entries in tlb_batch_va, or TLB_FLUSH_ALL
+	uintptr_t tlb_batch_va[TLB_BATCH_MAX];
+	struct PageInfo *tlb_batch_free;	// To free at tlb_batch_end
+
+	// Statistics
+	uint32_t tlb_sent;		// Shootdown IPIs sent
+	uint32_t tlb_recv;		// Mailbox requests processed
+};
+
+static struct TlbState tlb_states[NCPU];
+
+// Reverse mappings.
+//
+// page_insert and page_remove keep, for every page, the set of page
+// table entries that map it in pp_rmap.  A page mapped once (the
+// common case) stores the pte_t pointer itself.  A page mapped more
+// than once stores a pointer to a chain of RmapEntry's, tagged with
+// RMAP_CHAIN in bit 0.  The (pgdir, va) of an entry is derived from
+// the pointer: a page table made by pgdir_walk has PP_PGTABLE set and
+// records its page directory entry in pp_rmap, and an entry that is
+// not in such a page table is a superpage's page directory entry.
+//
+// Chain entries come from a small static pool, so reverse mappings
+// work before the slab allocator is up, and after that from the
+// "rmap" kmem cache.
+#define RMAP_CHAIN	0x1
+#define RMAP_NBOOT	32	// Entries in the static pool
+
+struct RmapEntry {
+	pte_t *re_pte;
+	struct RmapEntry *re_next;
+};
+
+static struct RmapEntry rmap_boot_entries[RMAP_NBOOT];
+static struct RmapEntry *rmap_free_entries;	// Free boot entries
+static struct kmem_cache *rmap_cache;
+
+// Protects pp_rmap of mapped pages and the entry pool.  A page can be
+// mapped by several environments, whose locks say nothing about each
+// other's mappings.
+static struct spinlock rmap_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "rmap_lock"
+#endif
+};
+
+// The magazines and the buddy allocator stay off while mem_init's
+// checks play with page_free_list directly.
+static bool page_mag_enabled;
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -67,6 +223,17 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void buddy_init(void);
+static void check_buddy(void);
+static void check_superpage(void);
+static void check_page_zero(void);
+static void check_tlb_batch(void);
+static void check_rmap(void);
+static int rmap_add(struct PageInfo *pp, pte_t *ptep);
+static void rmap_remove(struct PageInfo *pp, pte_t *ptep);
+static void rmap_clear(struct PageInfo *pp);
+static void tlb_shootdown(pde_t *pgdir, const uintptr_t *va, int nva);
+static void tlb_batch_free(pde_t *pgdir, struct PageInfo *pp);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -237,7 +404,11 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
+
+	// Allow 4MB superpage mappings (PTE_PS page directory entries)
+	// in user page directories.
+	lcr4(rcr4() | CR4_PSE);
 
 	check_page_free_list(0);
 
@@ -250,6 +421,19 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// From now on page_alloc and page_free go through the per-CPU
+	// magazines, backed by the buddy allocator.
+	buddy_init();
+	page_mag_enabled = 1;
+
+	check_buddy();
+	check_superpage();
+	check_page_zero();
+	check_tlb_batch();
+	check_rmap();
+
+	kmem_init();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -329,6 +513,7 @@ page_init(void)
 	size_t kernel_end = io_hole_end + (size_t) (boot_alloc(0) - KERNBASE) / PGSIZE;
 	size_t mpentry_pgnum = MPENTRY_PADDR / PGSIZE;
 	page_free_list = NULL;
+	page_depot_count = 0;
 
 	// i < 0x40FF
 	for (i = 0; i < npages; i++) {
@@ -341,6 +526,7 @@ page_init(void)
 			pages[i].pp_ref = 0;
 			pages[i].pp_link = page_free_list;
 			page_free_list = &pages[i];
+			page_depot_count++;
 		// 3) 0xA0 <= i < 0x100
 		} else if (io_hole_begin <= i && i < io_hole_end) {
 			pages[i].pp_ref = 1;
@@ -354,10 +540,225 @@ page_init(void)
 			pages[i].pp_ref = 0;
 			pages[i].pp_link = page_free_list;
 			page_free_list = &pages[i];
+			page_depot_count++;
 		}
 	}
 }
 
+//
+// Buddy allocator internals.  The caller must hold page_depot_lock.
+//
+
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_BUDDY;
+	pp->pp_link = buddy_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = &pp->pp_link;
+	pp->pp_pprev = &buddy_free_area[order];
+	buddy_free_area[order] = pp;
+	buddy_nfree[order]++;
+}
+
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	*pp->pp_pprev = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = pp->pp_pprev;
+	buddy_nfree[pp->pp_order]--;
+	pp->pp_link = NULL;
+	pp->pp_pprev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+}
+
+// Take a free block of 2^order pages, splitting a larger one if needed.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && !buddy_free_area[k]; k++)
+		/* do nothing */;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = buddy_free_area[k];
+	buddy_unlink(pp);
+	// Give the upper halves back, one order at a time
+	while (k > order) {
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+
+	pp->pp_order = order;
+	page_depot_count -= 1 << order;
+	return pp;
+}
+
+// Return a block of 2^order pages, merging it with free buddies.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t idx = pp - pages, bidx;
+
+	page_depot_count += 1 << order;
+	while (order < PAGE_MAX_ORDER) {
+		bidx = idx ^ (1 << order);
+		if (bidx >= npages
+		    || !(pages[bidx].pp_flags & PP_BUDDY)
+		    || pages[bidx].pp_order != order)
+			break;
+		buddy_unlink(&pages[bidx]);
+		idx &= ~(1 << order);
+		order++;
+	}
+	buddy_push(&pages[idx], order);
+}
+
+//
+// Hand every page left on the boot-time free list over to the buddy
+// allocator.  Called once, at the end of mem_init.
+//
+static void
+buddy_init(void)
+{
+	struct PageInfo *pp, *next;
+
+	page_depot_count = 0;
+	for (pp = page_free_list; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	page_free_list = NULL;
+}
+
+//
+// Move up to PAGE_MAG_BATCH pages from the depot into 'mag'.
+//
+static void
+page_mag_refill(struct PageMagazine *mag)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_depot_lock);
+	for (n = 0; n < PAGE_MAG_BATCH; n++) {
+		if ((pp = buddy_alloc(0)) == NULL)
+			break;
+		pp->pp_link = mag->pm_head;
+		mag->pm_head = pp;
+	}
+	spin_unlock(&page_depot_lock);
+
+	mag->pm_count += n;
+	mag->pm_depot_out += n;
+}
+
+//
+// Move PAGE_MAG_BATCH pages (or all of them, if there are fewer)
+// from 'mag' back to the depot.
+//
+static void
+page_mag_drain(struct PageMagazine *mag)
+{
+	struct PageInfo *pp;
+	int n;
+
+	spin_lock(&page_depot_lock);
+	for (n = 0; n < PAGE_MAG_BATCH && mag->pm_head; n++) {
+		pp = mag->pm_head;
+		mag->pm_head = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_depot_lock);
+
+	mag->pm_count -= n;
+	mag->pm_depot_in += n;
+}
+
+//
+// Take a page from the pre-zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL) {
+		page_zero_list = pp->pp_link;
+		page_zero_count--;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+//
+// Give every page in the pre-zeroed pool back to the buddy allocator,
+// so that they can coalesce into larger blocks again.
+//
+static void
+page_zero_release(void)
+{
+	struct PageInfo *pp, *next;
+
+	spin_lock(&page_zero_lock);
+	pp = page_zero_list;
+	page_zero_list = NULL;
+	page_zero_count = 0;
+	spin_unlock(&page_zero_lock);
+
+	spin_lock(&page_depot_lock);
+	for (; pp; pp = next) {
+		next = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_depot_lock);
+}
+
+//
+// Zero up to PAGE_ZERO_BATCH free pages and add them to the pre-zeroed
+// pool.  Called by CPUs about to halt.
+//
+void
+page_zero_fill(void)
+{
+	struct PageMagazine *mag;
+	struct PageInfo *pp;
+	int n;
+
+	if (!page_mag_enabled)
+		return;
+
+	mag = &page_magazines[cpunum()];
+	// page_zero_count is read without the lock; the pool may end up
+	// a few pages over PAGE_ZERO_MAX, which is harmless.
+	for (n = 0; n < PAGE_ZERO_BATCH && page_zero_count < PAGE_ZERO_MAX; n++) {
+		if (mag->pm_head == NULL)
+			page_mag_refill(mag);
+		if ((pp = mag->pm_head) == NULL)
+			break;
+		mag->pm_head = pp->pp_link;
+		mag->pm_count--;
+
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_zero_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		page_zero_filled++;
+		spin_unlock(&page_zero_lock);
+	}
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -374,12 +775,47 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	struct PageInfo *pp = page_free_list;
-	if (pp == NULL) {
-		return NULL;
+	struct PageInfo *pp;
+
+	if (page_mag_enabled) {
+		struct PageMagazine *mag = &page_magazines[cpunum()];
+
+		// A pre-zeroed page saves the memset below
+		if (alloc_flags & ALLOC_ZERO) {
+			if ((pp = page_zero_pop()) != NULL) {
+				mag->pm_zero_hit++;
+				pp->pp_link = NULL;
+				return pp;
+			}
+			mag->pm_zero_miss++;
+		}
+
+		if (mag->pm_head == NULL) {
+			mag->pm_alloc_miss++;
+			page_mag_refill(mag);
+		} else {
+			mag->pm_alloc_hit++;
+		}
+
+		if ((pp = mag->pm_head) != NULL) {
+			mag->pm_head = pp->pp_link;
+			mag->pm_count--;
+		} else if ((pp = page_zero_pop()) == NULL) {
+			// Not even the pre-zeroed pool has pages left
+			return NULL;
+		}
+	} else {
+		spin_lock(&page_depot_lock);
+		if ((pp = page_free_list) != NULL) {
+			page_free_list = pp->pp_link;
+			page_depot_count--;
+		}
+		spin_unlock(&page_depot_lock);
+
+		if (pp == NULL)
+			return NULL;
 	}
 
-	page_free_list = pp->pp_link;
 	pp->pp_link = NULL;
 
 	if (alloc_flags & ALLOC_ZERO) {
@@ -404,8 +840,137 @@ page_free(struct PageInfo *pp)
 		return;
 	}
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	// Forget any reverse mappings left by code that edits page tables
+	// by hand (as the checks below do)
+	rmap_clear(pp);
+
+	// The head of a page_alloc_order block frees the whole block
+	if (pp->pp_order != 0) {
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	if (page_mag_enabled) {
+		struct PageMagazine *mag = &page_magazines[cpunum()];
+		if (mag->pm_count >= PAGE_MAG_SIZE) {
+			mag->pm_free_miss++;
+			page_mag_drain(mag);
+		} else {
+			mag->pm_free_hit++;
+		}
+
+		pp->pp_link = mag->pm_head;
+		mag->pm_head = pp;
+		mag->pm_count++;
+	} else {
+		spin_lock(&page_depot_lock);
+		pp->pp_link = page_free_list;
+		page_free_list = pp;
+		page_depot_count++;
+		spin_unlock(&page_depot_lock);
+	}
+}
+
+//
+// Allocates 2^order physically contiguous pages from the buddy
+// allocator and returns the PageInfo of the first one.  The block is
+// aligned to its size.  If (alloc_flags & ALLOC_ZERO), the whole block
+// is filled with '\0' bytes.  Like page_alloc, does NOT increment the
+// reference count; the reference count of the first page stands for the
+// whole block, and page_free (or page_decref) of that page releases all
+// of it.
+//
+// Returns NULL if order is out of range or no such block is free.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (!page_mag_enabled)
+		return NULL;
+
+	spin_lock(&page_depot_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_depot_lock);
+
+	if (pp == NULL) {
+		// The pages cached on this CPU or in the pre-zeroed pool may
+		// be what keeps a larger block from coalescing; give them
+		// back and try once more.
+		struct PageMagazine *mag = &page_magazines[cpunum()];
+		while (mag->pm_head)
+			page_mag_drain(mag);
+		page_zero_release();
+
+		spin_lock(&page_depot_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_depot_lock);
+		if (pp == NULL)
+			return NULL;
+	}
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block allocated with page_alloc_order(order, ...).
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+
+	if (pp->pp_ref > 0 || pp->pp_link != NULL || pp->pp_order != order
+	    || (pp - pages) % (1 << order) != 0)
+		panic("page_free_order failed: %p is not a free-able order %d block",
+		      page2pa(pp), order);
+
+	spin_lock(&page_depot_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_depot_lock);
+}
+
+//
+// Print the per-CPU magazine counters and the state of the depot.
+// Used by the 'pagestat' monitor command.
+//
+void
+page_stat_print(void)
+{
+	struct PageMagazine *mag;
+	uint32_t allocs, frees, zeros;
+	int i;
+
+	cprintf("depot: %u free pages\n", page_depot_count);
+	cprintf("buddy:");
+	for (i = 0; i <= PAGE_MAX_ORDER; i++)
+		cprintf(" %u", buddy_nfree[i]);
+	cprintf(" (free blocks of order 0..%d)\n", PAGE_MAX_ORDER);
+	cprintf("zero pool: %u/%u pages, %u zeroed while idle\n",
+		page_zero_count, PAGE_ZERO_MAX, page_zero_filled);
+	for (i = 0; i < ncpu; i++) {
+		mag = &page_magazines[i];
+		allocs = mag->pm_alloc_hit + mag->pm_alloc_miss;
+		frees = mag->pm_free_hit + mag->pm_free_miss;
+		zeros = mag->pm_zero_hit + mag->pm_zero_miss;
+		cprintf("CPU %d: %d cached, alloc %u (%u%% hit), free %u (%u%% hit), "
+			"depot out %u in %u, zero %u (%u%% hit)\n",
+			i, mag->pm_count,
+			allocs, allocs ? mag->pm_alloc_hit * 100 / allocs : 0,
+			frees, frees ? mag->pm_free_hit * 100 / frees : 0,
+			mag->pm_depot_out, mag->pm_depot_in,
+			zeros, zeros ? mag->pm_zero_hit * 100 / zeros : 0);
+	}
 }
 
 //
@@ -415,7 +980,8 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	// Atomic, since the page may be mapped by several environments
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
 		page_free(pp);
 }
 
@@ -441,6 +1007,12 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' is covered by a 4MB superpage, there is no page table to walk
+// and pgdir_walk returns a pointer to the PTE_PS page directory entry
+// itself.  Its permission bits mean the same as a PTE's, but callers
+// that want to store a 4KB mapping there must remove the superpage
+// first.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -448,13 +1020,17 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// page directory map VA to PA of page table
 	pde_t *ppde = &pgdir[PDX(va)];
 
-	if (*ppde & PTE_P) {
+	if (*ppde & PTE_PS) {
+		return (pte_t *) ppde;
+	} else if (*ppde & PTE_P) {
 		page_table = (pte_t *) KADDR(PTE_ADDR(*ppde));
 	// The relevant page
 	} else if (create) {
 		struct PageInfo *pp = page_alloc(ALLOC_ZERO);
 		if (pp != NULL) {
 			pp->pp_ref++;
+			pp->pp_flags |= PP_PGTABLE;
+			pp->pp_rmap = (uintptr_t) ppde;
 			*ppde = PTE_ADDR(page2pa(pp)) | PTE_U | PTE_W | PTE_P;
 			page_table = (pte_t *) page2kva(pp);
 		}
@@ -511,6 +1087,8 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// If 'va' is covered by a superpage, the whole superpage is removed.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
@@ -521,12 +1099,21 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+	if (pgdir[PDX(va)] & PTE_PS) {
+		page_remove(pgdir, va);
+	}
+
 	pte_t *ppte = pgdir_walk(pgdir, va, 1);
 	if (ppte == NULL) {
 		return -E_NO_MEM;
 	}
+	// Recorded before the old mapping goes, in case it is this very
+	// page at this very address.
+	if (rmap_add(pp, ppte) < 0) {
+		return -E_NO_MEM;
+	}
 
-	pp->pp_ref++;
+	__sync_add_and_fetch(&pp->pp_ref, 1);
 
 	if (*ppte & PTE_P) {
 		page_remove(pgdir, va);
@@ -537,6 +1124,58 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Map the 4MB block 'pp' (the first page of a page_alloc_order block of
+// order PAGE_MAX_ORDER) at the PTSIZE-aligned virtual address 'va' with
+// a single PTE_PS page directory entry, using permissions 'perm|PTE_P'.
+//
+// Anything mapped in [va, va+PTSIZE) before is removed, and the page
+// table covering the range, if any, is freed.  pp->pp_ref is
+// incremented; it counts superpage mappings of the whole block.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va or pp is not 4MB aligned
+//   -E_NO_MEM, if the reverse mapping couldn't be recorded
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *ppde = &pgdir[PDX(va)];
+	pte_t *pt;
+	struct PageInfo *ptpage;
+	int i;
+
+	if ((uintptr_t) va % PTSIZE != 0 || page2pa(pp) % PTSIZE != 0) {
+		return -E_INVAL;
+	}
+	if (rmap_add(pp, ppde) < 0) {
+		return -E_NO_MEM;
+	}
+
+	__sync_add_and_fetch(&pp->pp_ref, 1);
+
+	if (*ppde & PTE_PS) {
+		page_remove(pgdir, va);
+	} else if (*ppde & PTE_P) {
+		pt = (pte_t *) KADDR(PTE_ADDR(*ppde));
+		tlb_batch_begin(pgdir);
+		for (i = 0; i < NPTENTRIES; i++) {
+			if (pt[i] & PTE_P) {
+				page_remove(pgdir, va + i * PGSIZE);
+			}
+		}
+		tlb_batch_end();
+		ptpage = pa2page(PTE_ADDR(*ppde));
+		*ppde = 0;
+		page_decref(ptpage);
+	}
+
+	*ppde = page2pa(pp) | perm | PTE_PS | PTE_P;
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -546,6 +1185,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va is covered by a superpage, returns the first page of the 4MB
+// block, and the "pte" stored is the PTE_PS page directory entry.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -557,7 +1199,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 		*pte_store = ppte;
 	}
 
-	if (ppte && (*ppte & PTE_P)) {
+	if (ppte && (*ppte & PTE_PS)) {
+		return pa2page(PTE_ADDR(*ppte));
+	} else if (ppte && (*ppte & PTE_P)) {
 		return pa2page(PTE_ADDR(*ppte) + PGOFF(va));
 	} else {
 		return NULL;
@@ -575,6 +1219,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
+//   - If va is covered by a superpage, the whole 4MB mapping goes.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
@@ -585,24 +1230,485 @@ page_remove(pde_t *pgdir, void *va)
 	pte_t *ppte;
 	struct PageInfo *pp = page_lookup(pgdir, va, &ppte);
 	if (pp != NULL) {
-		page_decref(pp);
+		rmap_remove(pp, ppte);
 		if (ppte != NULL) {
 			*ppte = 0;
 		}
 		tlb_invalidate(pgdir, va);
+		// Not before the invalidation (see "TLB shootdown" above)
+		if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0) {
+			tlb_batch_free(pgdir, pp);
+		}
+	}
+}
+
+//
+// Break copy-on-write for the page at 'va' in env's address space: make
+// the PTE_COW mapping there writable, on a copy of the page unless env
+// is the last one mapping it.  Counts the fault in env.
+// The caller must hold env's lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there is no copy-on-write page at 'va'
+//   -E_NO_MEM, if the page couldn't be copied
+//
+int
+page_cow_break(struct Env *env, void *va)
+{
+	pte_t *ppte;
+	struct PageInfo *pp, *copy;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	pp = page_lookup(env->env_pgdir, va, &ppte);
+	if (pp == NULL || (*ppte & (PTE_PS | PTE_COW | PTE_W | PTE_U)) != (PTE_COW | PTE_U))
+		return -E_INVAL;
+
+	// Nobody else can map it meanwhile, since that takes our lock
+	if (pp->pp_ref == 1) {
+		*ppte = (*ppte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(env->env_pgdir, va);
+		env->env_cow_faults++;
+		return 0;
 	}
+
+	if ((copy = page_alloc(0)) == NULL)
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	perm = (*ppte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if ((r = page_insert(env->env_pgdir, copy, va, perm)) < 0) {
+		page_free(copy);
+		return r;
+	}
+	env->env_cow_faults++;
+	env->env_cow_copies++;
+	return 0;
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Reverse map internals.
+//
+
+static struct RmapEntry *
+rmap_entry_alloc(void)
+{
+	static int nboot;
+	struct RmapEntry *re;
+
+	if (rmap_free_entries) {
+		re = rmap_free_entries;
+		rmap_free_entries = re->re_next;
+	} else if (nboot < RMAP_NBOOT) {
+		re = &rmap_boot_entries[nboot++];
+	} else {
+		if (!rmap_cache && !(rmap_cache = kmem_cache_create("rmap",
+				sizeof(struct RmapEntry), sizeof(struct RmapEntry))))
+			return NULL;
+		if (!(re = kmem_cache_alloc(rmap_cache)))
+			return NULL;
+	}
+	re->re_next = NULL;
+	return re;
+}
+
+static void
+rmap_entry_free(struct RmapEntry *re)
+{
+	if (re >= rmap_boot_entries && re < rmap_boot_entries + RMAP_NBOOT) {
+		re->re_next = rmap_free_entries;
+		rmap_free_entries = re;
+	} else
+		kmem_cache_free(rmap_cache, re);
+}
+
+// Record that *ptep maps pp.
+static int
+rmap_add(struct PageInfo *pp, pte_t *ptep)
+{
+	struct RmapEntry *re, *first;
+	int r = 0;
+
+	spin_lock(&rmap_lock);
+	if (pp->pp_rmap == 0) {
+		pp->pp_rmap = (uintptr_t) ptep;
+		goto out;
+	}
+
+	if (!(re = rmap_entry_alloc())) {
+		r = -E_NO_MEM;
+		goto out;
+	}
+	if (!(pp->pp_rmap & RMAP_CHAIN)) {
+		// Second mapping: move the first one into the chain too
+		if (!(first = rmap_entry_alloc())) {
+			rmap_entry_free(re);
+			r = -E_NO_MEM;
+			goto out;
+		}
+		first->re_pte = (pte_t *) pp->pp_rmap;
+		pp->pp_rmap = (uintptr_t) first | RMAP_CHAIN;
+	}
+	re->re_pte = ptep;
+	re->re_next = (struct RmapEntry *) (pp->pp_rmap & ~RMAP_CHAIN);
+	pp->pp_rmap = (uintptr_t) re | RMAP_CHAIN;
+out:
+	spin_unlock(&rmap_lock);
+	return r;
+}
+
+// Forget that *ptep maps pp.
+static void
+rmap_remove(struct PageInfo *pp, pte_t *ptep)
+{
+	struct RmapEntry *head, *re, **pre;
+
+	spin_lock(&rmap_lock);
+	if (!(pp->pp_rmap & RMAP_CHAIN)) {
+		if (pp->pp_rmap == (uintptr_t) ptep)
+			pp->pp_rmap = 0;
+		goto out;
+	}
+
+	head = (struct RmapEntry *) (pp->pp_rmap & ~RMAP_CHAIN);
+	for (pre = &head; (re = *pre) != NULL; pre = &re->re_next)
+		if (re->re_pte == ptep)
+			break;
+	if (re == NULL)
+		goto out;
+	*pre = re->re_next;
+	rmap_entry_free(re);
+
+	// A chain has at least two entries, so head is not NULL here
+	if (!head->re_next) {
+		// Back to a single mapping: store it inline again
+		pp->pp_rmap = (uintptr_t) head->re_pte;
+		rmap_entry_free(head);
+	} else {
+		pp->pp_rmap = (uintptr_t) head | RMAP_CHAIN;
+	}
+out:
+	spin_unlock(&rmap_lock);
+}
+
+// Forget every mapping of pp, which is being freed.
+static void
+rmap_clear(struct PageInfo *pp)
+{
+	struct RmapEntry *re, *next;
+
+	if (pp->pp_rmap & RMAP_CHAIN) {
+		spin_lock(&rmap_lock);
+		for (re = (struct RmapEntry *) (pp->pp_rmap & ~RMAP_CHAIN); re; re = next) {
+			next = re->re_next;
+			rmap_entry_free(re);
+		}
+		spin_unlock(&rmap_lock);
+	}
+	pp->pp_rmap = 0;
+	pp->pp_flags &= ~PP_PGTABLE;
+}
+
+// Find the page directory and virtual address that *ptep maps.
+static void
+rmap_resolve(pte_t *ptep, pde_t **pgdir_store, uintptr_t *va_store)
+{
+	struct PageInfo *ptpage = pa2page(PADDR(ptep));
+	pde_t *ppde;
+
+	if (ptpage->pp_flags & PP_PGTABLE) {
+		ppde = (pde_t *) ptpage->pp_rmap;
+		*va_store = (uintptr_t) PGADDR(PGOFF(ppde) / sizeof(pde_t),
+					       PGOFF(ptep) / sizeof(pte_t), 0);
+	} else {
+		// A superpage's page directory entry
+		ppde = ptep;
+		*va_store = (uintptr_t) PGADDR(PGOFF(ppde) / sizeof(pde_t), 0, 0);
+	}
+	*pgdir_store = (pde_t *) ROUNDDOWN(ppde, PGSIZE);
+}
+
+//
+// Call fn(pgdir, va, ptep, arg) for every mapping of pp recorded in its
+// reverse map, where ptep is the entry (a PDE for superpages) that
+// maps pp at va in pgdir.  Stops early and returns fn's value if fn
+// returns non-zero; returns 0 otherwise.
+//
+// fn must not change the mappings of pp; see page_unmap_all for that.
+// It runs with the reverse map locked, so it must not take any lock
+// above rmap_lock in the lock order (see kern/spinlock.h).
+//
+int
+page_rmap_walk(struct PageInfo *pp,
+	       int (*fn)(pde_t *pgdir, void *va, pte_t *ptep, void *arg),
+	       void *arg)
+{
+	struct RmapEntry *re;
+	pde_t *pgdir;
+	uintptr_t va;
+	int r = 0;
+
+	if (pp->pp_flags & PP_PGTABLE)
+		return 0;
+
+	spin_lock(&rmap_lock);
+	if (!(pp->pp_rmap & RMAP_CHAIN)) {
+		if (pp->pp_rmap != 0) {
+			rmap_resolve((pte_t *) pp->pp_rmap, &pgdir, &va);
+			r = fn(pgdir, (void *) va, (pte_t *) pp->pp_rmap, arg);
+		}
+	} else {
+		for (re = (struct RmapEntry *) (pp->pp_rmap & ~RMAP_CHAIN); re; re = re->re_next) {
+			rmap_resolve(re->re_pte, &pgdir, &va);
+			if ((r = fn(pgdir, (void *) va, re->re_pte, arg)) != 0)
+				break;
+		}
+	}
+	spin_unlock(&rmap_lock);
+	return r;
+}
+
+//
+// Remove every mapping of pp, in every page directory, as page_remove
+// would.  pp is freed if that drops its last reference.
+// Returns the number of mappings removed.
+//
+// The caller must make sure nobody else edits the page tables that map
+// pp meanwhile, for example by holding the locks of the environments
+// they belong to.
+//
+int
+page_unmap_all(struct PageInfo *pp)
+{
+	pte_t *ptep;
+	pde_t *pgdir;
+	uintptr_t va;
+	int n;
+
+	if (pp->pp_flags & PP_PGTABLE)
+		return 0;
+
+	for (n = 0; ; n++) {
+		spin_lock(&rmap_lock);
+		if (pp->pp_rmap == 0)
+			ptep = NULL;
+		else if (pp->pp_rmap & RMAP_CHAIN)
+			ptep = ((struct RmapEntry *) (pp->pp_rmap & ~RMAP_CHAIN))->re_pte;
+		else
+			ptep = (pte_t *) pp->pp_rmap;
+		spin_unlock(&rmap_lock);
+		if (ptep == NULL)
+			return n;
+		rmap_resolve(ptep, &pgdir, &va);
+		page_remove(pgdir, (void *) va);
+	}
+}
+
+//
+// Invalidate a TLB entry, on this CPU if the page tables being edited
+// are the ones it has loaded, and on every other CPU that has them
+// loaded (see "TLB shootdown" above).  Inside a batch for 'pgdir',
+// the invalidation is deferred to tlb_batch_end.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbState *ts = &tlb_states[cpunum()];
+	uintptr_t addr = (uintptr_t) va;
+
+	if (ts->tlb_batch_depth > 0 && ts->tlb_batch_pgdir == pgdir) {
+		if (ts->tlb_batch_nva < TLB_BATCH_MAX)
+			ts->tlb_batch_va[ts->tlb_batch_nva++] = addr;
+		else
+			ts->tlb_batch_nva = TLB_FLUSH_ALL;
+		return;
+	}
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (ts->tlb_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir, &addr, 1);
+}
+
+//
+// Load 'pgdir' into CR3 on this CPU, and record it as the page
+// directory other CPUs must shoot down TLB entries for.
+//
+void
+pgdir_switch(pde_t *pgdir)
+{
+	// Record before loading: a shootdown that misses the new value
+	// changed the page tables before our CR3 load flushed the TLB.
+	xchg((uint32_t *) &tlb_states[cpunum()].tlb_pgdir, (uint32_t) pgdir);
+	lcr3(PADDR(pgdir));
+}
+
+//
+// Flush the addresses posted to this CPU's mailbox.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct TlbState *ts = &tlb_states[cpunum()];
+	int i;
+
+	if (ts->tlb_done == ts->tlb_req)
+		return;
+
+	spin_lock(&ts->tlb_lock);
+	if (ts->tlb_nva == TLB_FLUSH_ALL)
+		lcr3(rcr3());
+	else
+		for (i = 0; i < ts->tlb_nva; i++)
+			invlpg((void *) ts->tlb_va[i]);
+	ts->tlb_nva = 0;
+	ts->tlb_recv++;
+	ts->tlb_done = ts->tlb_req;
+	spin_unlock(&ts->tlb_lock);
+}
+
+//
+// Called right before this CPU returns to user mode, and on every trap
+// from user mode.  The xchg orders the flag against the mailbox, which
+// tlb_shootdown posts to before it reads the flag.
+//
+void
+tlb_user_enter(void)
+{
+	xchg(&tlb_states[cpunum()].tlb_in_user, 1);
+	tlb_shootdown_poll();
+}
+
+void
+tlb_user_leave(void)
+{
+	xchg(&tlb_states[cpunum()].tlb_in_user, 0);
+	tlb_shootdown_poll();
+}
+
+//
+// Ask every other CPU that has 'pgdir' loaded to flush 'nva' addresses
+// starting at 'va' (or everything, if nva is TLB_FLUSH_ALL), and wait
+// for the ones running user code to do so.
+//
+static void
+tlb_shootdown(pde_t *pgdir, const uintptr_t *va, int nva)
+{
+	struct TlbState *me = &tlb_states[cpunum()], *ts;
+	uint32_t seq[NCPU];
+	bool wait[NCPU];
+	int c, i;
+
+	for (c = 0; c < ncpu; c++) {
+		ts = &tlb_states[c];
+		wait[c] = 0;
+		if (ts == me || ts->tlb_pgdir != pgdir)
+			continue;
+
+		spin_lock(&ts->tlb_lock);
+		if (nva == TLB_FLUSH_ALL || ts->tlb_nva + nva > TLB_BATCH_MAX)
+			ts->tlb_nva = TLB_FLUSH_ALL;
+		else
+			for (i = 0; i < nva; i++)
+				ts->tlb_va[ts->tlb_nva++] = va[i];
+		seq[c] = ++ts->tlb_req;
+		spin_unlock(&ts->tlb_lock);
+
+		if (ts->tlb_in_user) {
+			lapic_ipi_cpu(cpus[c].cpu_id, IRQ_OFFSET + IRQ_TLB);
+			me->tlb_sent++;
+			wait[c] = 1;
+		}
+	}
+
+	for (c = 0; c < ncpu; c++)
+		if (wait[c])
+			while ((int32_t) (tlb_states[c].tlb_done - seq[c]) < 0)
+				asm volatile("pause");
+}
+
+//
+// Start collecting invalidations for 'pgdir' instead of sending them
+// one by one.  The caller must not use the affected mappings until the
+// matching tlb_batch_end.  Batches nest; invalidations for any other
+// page directory are not deferred.
+//
+void
+tlb_batch_begin(pde_t *pgdir)
+{
+	struct TlbState *ts = &tlb_states[cpunum()];
+
+	if (ts->tlb_batch_depth++ == 0) {
+		ts->tlb_batch_pgdir = pgdir;
+		ts->tlb_batch_nva = 0;
+	}
+}
+
+//
+// Flush everything collected since the outermost tlb_batch_begin,
+// locally and on other CPUs, in a single shootdown round.
+//
+void
+tlb_batch_end(void)
+{
+	struct TlbState *ts = &tlb_states[cpunum()];
+	struct PageInfo *pp;
+	int i;
+
+	assert(ts->tlb_batch_depth > 0);
+	if (--ts->tlb_batch_depth > 0)
+		return;
+
+	if (ts->tlb_batch_nva != 0) {
+		if (ts->tlb_pgdir == ts->tlb_batch_pgdir) {
+			if (ts->tlb_batch_nva == TLB_FLUSH_ALL)
+				lcr3(rcr3());
+			else
+				for (i = 0; i < ts->tlb_batch_nva; i++)
+					invlpg((void *) ts->tlb_batch_va[i]);
+		}
+		tlb_shootdown(ts->tlb_batch_pgdir, ts->tlb_batch_va, ts->tlb_batch_nva);
+		ts->tlb_batch_nva = 0;
+	}
+
+	while ((pp = ts->tlb_batch_free) != NULL) {
+		ts->tlb_batch_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+//
+// Free 'pp', whose last mapping in 'pgdir' was just invalidated: right
+// away, or at tlb_batch_end if that invalidation is still deferred.
+//
+static void
+tlb_batch_free(pde_t *pgdir, struct PageInfo *pp)
+{
+	struct TlbState *ts = &tlb_states[cpunum()];
+
+	if (ts->tlb_batch_depth > 0 && ts->tlb_batch_pgdir == pgdir) {
+		pp->pp_link = ts->tlb_batch_free;
+		ts->tlb_batch_free = pp;
+	} else {
+		page_free(pp);
+	}
+}
+
+//
+// Print the per-CPU shootdown counters.
+// Used by the 'tlbstat' monitor command.
+//
+void
+tlb_stat_print(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		cprintf("CPU %d: %u shootdown IPIs sent, %u requests received\n",
+			i, tlb_states[i].tlb_sent, tlb_states[i].tlb_recv);
 }
 
 //
@@ -664,6 +1770,10 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// Copy-on-write pages in the range count as writable: if perm includes
+// PTE_W, copy-on-write is broken for them, so the caller must hold env's
+// lock then.
+//
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
@@ -677,7 +1787,13 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	perm |= PTE_P;
 
 	for (; begin < end; begin += PGSIZE) {
+		// for a superpage this is the PTE_PS page directory entry,
+		// whose permission bits are checked the same way
 		pte_t *ppte = pgdir_walk(env->env_pgdir, (void *) begin, 0);
+		// the kernel writes to a copy-on-write page the way the
+		// user would, after breaking copy-on-write
+		if ((perm & PTE_W) && ppte && (*ppte & PTE_COW))
+			page_cow_break(env, (void *) begin);
 		// if permission not correct or address above ULIM
 		if (ppte == NULL || (*ppte & perm) != perm || begin > ULIM) {
 			user_mem_check_addr = (begin < vanum? vanum: begin);
@@ -694,6 +1810,8 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// The caller must hold env's lock, which stays held only if the
+// check succeeds.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
@@ -1151,3 +2269,265 @@ check_page_installed_pgdir(void)
 
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
+
+// check page_alloc_order and page_free_order, once the buddy allocator
+// has taken over from page_free_list
+static void
+check_buddy(void)
+{
+	struct PageInfo *pp0, *pp1;
+	size_t nfree, nbig;
+	char *c;
+	int i;
+
+	nfree = page_depot_count;
+	nbig = buddy_nfree[PAGE_MAX_ORDER];
+
+	// should be able to allocate two distinct, aligned 8-page blocks
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp1 = page_alloc_order(3, 0)));
+	assert((pp0 - pages) % 8 == 0);
+	assert((pp1 - pages) % 8 == 0);
+	assert(pp1 >= pp0 + 8 || pp0 >= pp1 + 8);
+	assert(page_depot_count == nfree - 16);
+
+	// ALLOC_ZERO clears the whole block
+	c = page2kva(pp0);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+
+	// freeing through page_decref releases the whole block
+	pp1->pp_ref++;
+	page_decref(pp1);
+	page_free_order(pp0, 3);
+	assert(page_depot_count == nfree);
+
+	// the pieces should have coalesced back into 4MB blocks
+	assert(buddy_nfree[PAGE_MAX_ORDER] == nbig);
+	if (nbig > 0) {
+		assert((pp0 = page_alloc_order(PAGE_MAX_ORDER, 0)));
+		assert(page2pa(pp0) % PTSIZE == 0);
+		page_free_order(pp0, PAGE_MAX_ORDER);
+		assert(buddy_nfree[PAGE_MAX_ORDER] == nbig);
+	}
+
+	// out of range orders are refused
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	cprintf("check_buddy() succeeded!\n");
+}
+
+// check page_insert_large and the superpage cases of pgdir_walk,
+// page_lookup, page_insert and page_remove
+static void
+check_superpage(void)
+{
+	struct PageInfo *pp0, *pp1, *pp2;
+	pte_t *ptep;
+	char *va = (char *) UTEMP;
+
+	assert(rcr4() & CR4_PSE);
+	assert(!kern_pgdir[PDX(va)]);
+
+	if (!(pp0 = page_alloc_order(PAGE_MAX_ORDER, ALLOC_ZERO))) {
+		cprintf("check_superpage() skipped: no free 4MB block\n");
+		return;
+	}
+	assert((pp1 = page_alloc(0)));
+
+	// misaligned addresses are refused
+	assert(page_insert_large(kern_pgdir, pp0, va + PGSIZE, PTE_W) < 0);
+	assert(page_insert_large(kern_pgdir, pp0 + 1, va, PTE_W) < 0);
+	assert(pp0->pp_ref == 0);
+
+	// map a 4KB page in the range, then replace it with the superpage;
+	// the page and its page table should be freed
+	pp1->pp_ref++;
+	assert(page_insert(kern_pgdir, pp1, va + 3 * PGSIZE, PTE_W) == 0);
+	pp2 = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+	assert(pp1->pp_ref == 2 && pp2->pp_ref == 1);
+	assert(page_insert_large(kern_pgdir, pp0, va, PTE_W) == 0);
+	assert(pp0->pp_ref == 1 && pp1->pp_ref == 1 && pp2->pp_ref == 0);
+	assert(kern_pgdir[PDX(va)] == (page2pa(pp0) | PTE_PS | PTE_W | PTE_P));
+
+	// the whole 4MB is reachable through the one PDE
+	assert(pgdir_walk(kern_pgdir, va + 5 * PGSIZE, 0) == &kern_pgdir[PDX(va)]);
+	assert(page_lookup(kern_pgdir, va + PTSIZE - 1, &ptep) == pp0);
+	assert(ptep == &kern_pgdir[PDX(va)]);
+	va[5 * PGSIZE + 7] = 0x42;
+	va[PTSIZE - 1] = 0x43;
+	assert(((char *) page2kva(pp0))[5 * PGSIZE + 7] == 0x42);
+	assert(((char *) page2kva(pp0))[PTSIZE - 1] == 0x43);
+
+	// re-inserting the same block at the same address is harmless
+	assert(page_insert_large(kern_pgdir, pp0, va, PTE_W) == 0);
+	assert(pp0->pp_ref == 1);
+
+	// a 4KB mapping inside the range replaces the superpage, and
+	// dropping the last reference frees the whole block
+	pp0->pp_ref++;
+	assert(page_insert(kern_pgdir, pp1, va + 3 * PGSIZE, PTE_W) == 0);
+	assert(pp0->pp_ref == 1 && pp1->pp_ref == 2);
+	assert(!(kern_pgdir[PDX(va)] & PTE_PS));
+	assert(check_va2pa(kern_pgdir, (uintptr_t) va + 3 * PGSIZE) == page2pa(pp1));
+	page_decref(pp0);
+	assert((pp0->pp_flags & PP_BUDDY) && pp0->pp_order == PAGE_MAX_ORDER);
+
+	// clean up
+	page_remove(kern_pgdir, va + 3 * PGSIZE);
+	pp2 = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+	kern_pgdir[PDX(va)] = 0;
+	page_decref(pp2);
+	page_decref(pp1);
+
+	cprintf("check_superpage() succeeded!\n");
+}
+
+// check the pre-zeroed page pool
+static void
+check_page_zero(void)
+{
+	struct PageInfo *pp0, *pp1;
+	size_t nzero;
+
+	// dirty a page and put it back, then let the pool pick up pages
+	assert((pp0 = page_alloc(0)));
+	memset(page2kva(pp0), 0xab, PGSIZE);
+	page_free(pp0);
+	nzero = page_zero_count;
+	page_zero_fill();
+	assert(page_zero_count > nzero);
+
+	// ALLOC_ZERO draws from the pool, and the page is clean
+	nzero = page_zero_count;
+	assert((pp1 = page_alloc(ALLOC_ZERO)));
+	assert(page_zero_count == nzero - 1);
+	assert(pp1->pp_link == NULL);
+	assert(((char *) page2kva(pp1))[0] == 0);
+	assert(((char *) page2kva(pp1))[PGSIZE - 1] == 0);
+	page_free(pp1);
+
+	cprintf("check_page_zero() succeeded!\n");
+}
+
+// check that batched invalidations take effect at tlb_batch_end
+static void
+check_tlb_batch(void)
+{
+	struct TlbState *ts = &tlb_states[cpunum()];
+	struct PageInfo *pp0, *pp1, *pp2;
+	char *va = (char *) UTEMP;
+	int i;
+
+	assert(ts->tlb_pgdir == kern_pgdir);
+	assert((pp0 = page_alloc(0)));
+	assert((pp1 = page_alloc(0)));
+	*(char *) page2kva(pp0) = 1;
+	*(char *) page2kva(pp1) = 2;
+	pp0->pp_ref++;
+	pp1->pp_ref++;
+
+	// touch the mapping so the TLB has it
+	assert(page_insert(kern_pgdir, pp0, va, PTE_W) == 0);
+	assert(*va == 1);
+
+	// replacing the page inside a batch defers the invalidation
+	tlb_batch_begin(kern_pgdir);
+	tlb_batch_begin(kern_pgdir);
+	assert(page_insert(kern_pgdir, pp1, va, PTE_W) == 0);
+	assert(ts->tlb_batch_nva == 1);
+	tlb_batch_end();
+	assert(ts->tlb_batch_nva == 1);
+	tlb_batch_end();
+	assert(ts->tlb_batch_nva == 0 && ts->tlb_batch_depth == 0);
+	assert(*va == 2);
+
+	// too many addresses turn into a full flush
+	tlb_batch_begin(kern_pgdir);
+	for (i = 0; i <= TLB_BATCH_MAX; i++)
+		tlb_invalidate(kern_pgdir, va + i * PGSIZE);
+	assert(ts->tlb_batch_nva == TLB_FLUSH_ALL);
+	assert(page_insert(kern_pgdir, pp0, va, PTE_W) == 0);
+	tlb_batch_end();
+	assert(*va == 1);
+
+	// a page unmapped for the last time is freed at the end of the batch
+	assert((pp2 = page_alloc(0)));
+	assert(page_insert(kern_pgdir, pp2, va + PGSIZE, PTE_W) == 0);
+	tlb_batch_begin(kern_pgdir);
+	page_remove(kern_pgdir, va + PGSIZE);
+	assert(pp2->pp_ref == 0 && ts->tlb_batch_free == pp2);
+	tlb_batch_end();
+	assert(ts->tlb_batch_free == NULL);
+
+	// clean up
+	page_remove(kern_pgdir, va);
+	pp2 = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+	kern_pgdir[PDX(va)] = 0;
+	page_decref(pp2);
+	page_decref(pp0);
+	page_decref(pp1);
+
+	cprintf("check_tlb_batch() succeeded!\n");
+}
+
+static int
+check_rmap_count(pde_t *pgdir, void *va, pte_t *ptep, void *arg)
+{
+	assert(pgdir == kern_pgdir);
+	assert(pgdir_walk(pgdir, va, 0) == ptep);
+	++*(int *) arg;
+	return 0;
+}
+
+// check the reverse mappings kept by page_insert and page_remove
+static void
+check_rmap(void)
+{
+	struct PageInfo *pp0, *pp1;
+	char *va = (char *) UTEMP;
+	int n;
+
+	assert((pp0 = page_alloc(0)));
+	pp0->pp_ref++;
+
+	// one mapping is stored inline
+	assert(page_insert(kern_pgdir, pp0, va, PTE_W) == 0);
+	assert(pp0->pp_rmap == (uintptr_t) pgdir_walk(kern_pgdir, va, 0));
+	pp1 = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+	assert((pp1->pp_flags & PP_PGTABLE) && pp1->pp_rmap == (uintptr_t) &kern_pgdir[PDX(va)]);
+
+	// more mappings, including one under another page table, chain up
+	assert(page_insert(kern_pgdir, pp0, va + PGSIZE, PTE_W) == 0);
+	assert(page_insert(kern_pgdir, pp0, va + PTSIZE, PTE_W) == 0);
+	assert(pp0->pp_rmap & RMAP_CHAIN);
+	n = 0;
+	assert(page_rmap_walk(pp0, check_rmap_count, &n) == 0 && n == 3);
+
+	// re-inserting at the same address does not duplicate it
+	assert(page_insert(kern_pgdir, pp0, va + PGSIZE, 0) == 0);
+	n = 0;
+	assert(page_rmap_walk(pp0, check_rmap_count, &n) == 0 && n == 3);
+
+	// back to one mapping: inline again
+	page_remove(kern_pgdir, va + PTSIZE);
+	page_remove(kern_pgdir, va + PGSIZE);
+	assert(pp0->pp_rmap == (uintptr_t) pgdir_walk(kern_pgdir, va, 0));
+
+	// unmapping everything leaves only our own reference
+	assert(page_insert(kern_pgdir, pp0, va + 2 * PGSIZE, PTE_W) == 0);
+	assert(page_unmap_all(pp0) == 2);
+	assert(pp0->pp_rmap == 0 && pp0->pp_ref == 1);
+	assert(check_va2pa(kern_pgdir, (uintptr_t) va) == ~0);
+	assert(check_va2pa(kern_pgdir, (uintptr_t) va + 2 * PGSIZE) == ~0);
+
+	// clean up
+	kern_pgdir[PDX(va)] = 0;
+	page_decref(pp1);
+	pp1 = pa2page(PTE_ADDR(kern_pgdir[PDX(va + PTSIZE)]));
+	kern_pgdir[PDX(va + PTSIZE)] = 0;
+	page_decref(pp1);
+	page_decref(pp0);
+
+	cprintf("check_rmap() succeeded!\n");
+}
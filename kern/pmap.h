@@ -51,17 +51,37 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_order hands out: 2^10 pages, i.e. 4MB.
+#define PAGE_MAX_ORDER	10
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
 int 	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+int	page_cow_break(struct Env *env, void *va);
+int	page_rmap_walk(struct PageInfo *pp,
+		       int (*fn)(pde_t *pgdir, void *va, pte_t *ptep, void *arg),
+		       void *arg);
+int	page_unmap_all(struct PageInfo *pp);
+void	page_zero_fill(void);
+void	page_stat_print(void);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(pde_t *pgdir);
+void	tlb_batch_end(void);
+void	tlb_shootdown_poll(void);
+void	tlb_user_enter(void);
+void	tlb_user_leave(void);
+void	tlb_stat_print(void);
+void	pgdir_switch(pde_t *pgdir);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
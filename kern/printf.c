@@ -5,6 +5,15 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Keeps the output of one cprintf from being interleaved with that of
+// another CPU.
+static struct spinlock printf_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "printf_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -18,7 +27,9 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	spin_lock(&printf_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	spin_unlock(&printf_lock);
 	return cnt;
 }
 
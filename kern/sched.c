@@ -1,91 +1,683 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/error.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/timer.h>
 
 void sched_halt(void);
 
+// Per-CPU run queues.
+//
+// Every ENV_RUNNABLE environment is on the run queue of one CPU,
+// normally the CPU it last ran on, and always one its affinity
+// allows.  Environments are put on a queue by sched_enqueue when they
+// become runnable, and taken off when a CPU picks them to run.  An
+// environment that stops being runnable while queued (it is killed,
+// or its status is set to ENV_NOT_RUNNABLE) is left where it is and
+// dropped when it reaches the front.  So a CPU that picks an env must
+// check, with the env locked, that it is still runnable; env_run does.
+//
+// The env_rq_* fields of an env are protected by the lock of the run
+// queue it is on.  Putting an env on a queue, or moving it between
+// levels, also requires the env's own lock.
+//
+// Fixed-priority envs sit in an array of FIFOs, one per priority
+// level, with a bitmap of the non-empty levels.  Bit 0 stands for
+// ENV_PRIO_MAX, so the best fixed-priority env is at the head of level
+// bsf(rq_bitmap), and envs of equal priority take turns.
+//
+// Fair envs sit in a min-heap ordered by virtual runtime: the user
+// mode TSC cycles an env has used, scaled down by its weight.  The
+// env that has had the least of its share so far runs next.
+//
+// In tickless mode (the default), a CPU's timer only fires when its
+// env may have to make way for another: it is armed on the way back
+// to user mode if other envs wait on the CPU's queue, and stopped
+// otherwise.  Idle CPUs halt with their timer stopped.  Whoever queues
+// an env sends an IRQ_RESCHED IPI to the queue's CPU if that CPU is
+// idle or another CPU's queue, else to an idle CPU that may steal it.
+// CPU 0, which runs the timer wheel, also arms its timer for the next
+// wheel event, busy or idle.
+struct RunLevel {
+	struct Env *rl_head;
+	struct Env **rl_tail;
+};
+
+struct RunQueue {
+	struct spinlock rq_lock;
+	int rq_len;			// Queued envs, including stale ones
+
+	// Fixed-priority class
+	uint32_t rq_bitmap;		// Non-empty levels
+	struct RunLevel rq_levels[ENV_NPRIO];
+
+	// Fair class
+	uint64_t rq_min_vruntime;	// Never decreases
+	int rq_nfair;
+	struct Env *rq_fair[NENV];	// Min-heap on env_vruntime
+
+	// This CPU's timer.  Only this CPU uses these.
+	bool rq_periodic;		// Timer in periodic mode
+	uint64_t rq_expire;		// When the one-shot timer fires, or 0
+	uint64_t rq_slice_end;		// When curenv's time slice ends
+} __attribute__((aligned(64)));
+
+// Whether the timer runs in one-shot mode
+bool sched_tickless = 1;
+
+// CPUs halted in sched_halt, bit i standing for CPU i
+static volatile uint32_t sched_idle;
+
+static struct RunQueue runqueues[NCPU];
+
+// Time slice of each fixed priority level, in timer ticks.
+static int sched_slices[ENV_NPRIO];
+
+#define PRIO_LEVEL(prio)	(ENV_PRIO_MAX - (prio))
+
+// Whether env e may run on CPU 'cpu'
+#define CPU_ALLOWED(e, cpu)	((e)->env_affinity & (1 << (cpu)))
+
+// Weight of a fair env at each priority, from ENV_PRIO_MIN up.  Each
+// step up gives about 25% more CPU time, as with nice levels.
+#define WEIGHT_PRIO_MIN		1024
+static const uint32_t sched_weights[ENV_NPRIO] = {
+	1024, 1277, 1586, 1991, 2501, 3121, 3906, 4904,
+	6100, 7620, 9548, 11916, 14949, 18705, 23254, 29154,
+	36291, 46273, 56483, 71755, 88761, 110951, 138689, 173361,
+	216701, 270876, 338595, 423244, 529055, 661319, 826649, 1033311,
+};
+
+void
+sched_init(void)
+{
+	struct RunQueue *rq;
+	int i, j;
+
+	static_assert(ENV_NPRIO <= 32);
+
+	for (i = 0; i < NCPU; i++) {
+		rq = &runqueues[i];
+		__spin_initlock(&rq->rq_lock, "rq_lock");
+		rq->rq_periodic = 1;
+		for (j = 0; j < ENV_NPRIO; j++) {
+			rq->rq_levels[j].rl_head = NULL;
+			rq->rq_levels[j].rl_tail = &rq->rq_levels[j].rl_head;
+		}
+	}
+	for (j = 0; j < ENV_NPRIO; j++)
+		sched_slices[j] = 1;
+}
+
+//
+// Fair class heap helpers.  The caller must hold rq_lock.
+//
+
+static void
+heap_set(struct RunQueue *rq, int i, struct Env *e)
+{
+	rq->rq_fair[i] = e;
+	e->env_heap_index = i;
+}
+
+static void
+heap_up(struct RunQueue *rq, int i)
+{
+	struct Env *e = rq->rq_fair[i];
+	int parent;
+
+	for (; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (rq->rq_fair[parent]->env_vruntime <= e->env_vruntime)
+			break;
+		heap_set(rq, i, rq->rq_fair[parent]);
+	}
+	heap_set(rq, i, e);
+}
+
+static void
+heap_down(struct RunQueue *rq, int i)
+{
+	struct Env *e = rq->rq_fair[i];
+	int child;
+
+	for (; (child = 2 * i + 1) < rq->rq_nfair; i = child) {
+		if (child + 1 < rq->rq_nfair
+		    && rq->rq_fair[child + 1]->env_vruntime < rq->rq_fair[child]->env_vruntime)
+			child++;
+		if (e->env_vruntime <= rq->rq_fair[child]->env_vruntime)
+			break;
+		heap_set(rq, i, rq->rq_fair[child]);
+	}
+	heap_set(rq, i, e);
+}
+
+// Add e to rq.  The caller must hold rq_lock.
+static void
+rq_link(struct RunQueue *rq, int cpu, struct Env *e)
+{
+	int level = PRIO_LEVEL(e->priority);
+	struct RunLevel *rl = &rq->rq_levels[level];
+
+	e->env_rq_cpu = cpu;
+	rq->rq_len++;
+	if (e->env_sched_class == ENV_SCHED_FAIR) {
+		// Envs that slept, are new, or come from another CPU
+		// start no further behind than the most-behind env here,
+		// so they cannot hog the CPU to catch up.
+		e->env_vruntime = MAX(e->env_vruntime, rq->rq_min_vruntime);
+		heap_set(rq, rq->rq_nfair, e);
+		heap_up(rq, rq->rq_nfair++);
+		return;
+	}
+
+	e->env_rq_next = NULL;
+	e->env_rq_pprev = rl->rl_tail;
+	*rl->rl_tail = e;
+	rl->rl_tail = &e->env_rq_next;
+	rq->rq_bitmap |= 1 << level;
+}
+
+// Remove e from rq.  The caller must hold rq_lock.
+static void
+rq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	int level = PRIO_LEVEL(e->priority);
+	struct RunLevel *rl = &rq->rq_levels[level];
+	struct Env *last;
+
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+	if (e->env_sched_class == ENV_SCHED_FAIR) {
+		// Move the last heap entry into e's place
+		last = rq->rq_fair[--rq->rq_nfair];
+		if (last != e) {
+			heap_set(rq, e->env_heap_index, last);
+			heap_up(rq, last->env_heap_index);
+			heap_down(rq, last->env_heap_index);
+		}
+		return;
+	}
+
+	*e->env_rq_pprev = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_pprev = e->env_rq_pprev;
+	else
+		rl->rl_tail = e->env_rq_pprev;
+	if (!rl->rl_head)
+		rq->rq_bitmap &= ~(1 << level);
+	e->env_rq_next = NULL;
+	e->env_rq_pprev = NULL;
+}
+
+// Let a CPU know that e was just queued on 'cpu', in tickless mode,
+// where nothing else would make it look.  That is the queue's CPU if
+// it is idle, else an idle CPU that may steal e, else the queue's CPU
+// unless it is this one, which checks its queue on its way back to
+// user mode anyway.
+static void
+sched_kick(int cpu, struct Env *e)
+{
+	uint32_t idle;
+
+	if (!sched_tickless)
+		return;
+	// Pairs with the locked OR in sched_halt: either we see the CPU
+	// idle, or it sees e on its queue before it halts.
+	__sync_synchronize();
+	idle = sched_idle & e->env_affinity;
+	if (idle & (1 << cpu))
+		;
+	else if (idle)
+		cpu = bsf(idle);
+	else if (cpu == cpunum())
+		return;
+	lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Put e, which must be ENV_RUNNABLE, on the run queue of the CPU it
+// last ran on.  Does nothing if e is already queued.
+// The caller must hold e's lock.
+void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	assert(e->env_status == ENV_RUNNABLE);
+	if (e->env_rq_cpu >= 0)
+		return;
+
+	cpu = (e->env_cpunum >= 0 && e->env_cpunum < ncpu) ? e->env_cpunum : cpunum();
+	if (!CPU_ALLOWED(e, cpu))
+		cpu = bsf(e->env_affinity);
+	rq = &runqueues[cpu];
+	spin_lock(&rq->rq_lock);
+	rq_link(rq, cpu, e);
+	spin_unlock(&rq->rq_lock);
+	sched_kick(cpu, e);
+}
+
+// Lock the run queue e is on, if any, and return it.  Since another
+// CPU may take e off its queue meanwhile, the queue is checked again
+// once locked.  The caller must hold e's lock, which keeps e from being
+// put on a queue.
+static struct RunQueue *
+rq_lock_env(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	while ((cpu = e->env_rq_cpu) >= 0) {
+		rq = &runqueues[cpu];
+		spin_lock(&rq->rq_lock);
+		if (e->env_rq_cpu == cpu)
+			return rq;
+		spin_unlock(&rq->rq_lock);
+	}
+	return NULL;
+}
+
+// Take e off its run queue, if it is on one.
+// The caller must hold e's lock.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+
+	if ((rq = rq_lock_env(e)) != NULL) {
+		rq_unlink(rq, e);
+		spin_unlock(&rq->rq_lock);
+	}
+}
+
+// Change e's scheduling class and priority, requeueing it if it is
+// queued.  The caller must hold e's lock.
+static void
+sched_change(struct Env *e, unsigned sched_class, int priority)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	if ((rq = rq_lock_env(e)) == NULL) {
+		e->env_sched_class = sched_class;
+		e->priority = priority;
+		return;
+	}
+
+	cpu = e->env_rq_cpu;
+	rq_unlink(rq, e);
+	e->env_sched_class = sched_class;
+	e->priority = priority;
+	rq_link(rq, cpu, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Change e's priority.  The caller must hold e's lock.
+void
+sched_set_priority(struct Env *e, int priority)
+{
+	assert(priority >= ENV_PRIO_MIN && priority <= ENV_PRIO_MAX);
+	sched_change(e, e->env_sched_class, priority);
+}
+
+// Move e to scheduling class 'sched_class'.
+// The caller must hold e's lock.
+void
+sched_set_class(struct Env *e, unsigned sched_class)
+{
+	assert(sched_class == ENV_SCHED_FAIR || sched_class == ENV_SCHED_FIXED);
+	sched_change(e, sched_class, e->priority);
+}
+
+// Restrict e to the CPUs in 'cpumask', which must include one that
+// exists, moving it to another run queue if need be.  If e is running
+// on another CPU it may no longer use, that CPU is told to switch away
+// from it: in tickless mode its timer may never fire otherwise.
+// The caller must hold e's lock.
+void
+sched_set_affinity(struct Env *e, uint32_t cpumask)
+{
+	struct RunQueue *rq;
+
+	e->env_affinity = cpumask;
+	if (e->env_status == ENV_RUNNING && !CPU_ALLOWED(e, e->env_cpunum)
+	    && e->env_cpunum != cpunum())
+		lapic_ipi_cpu(cpus[e->env_cpunum].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+	if ((rq = rq_lock_env(e)) == NULL)
+		return;
+	if (CPU_ALLOWED(e, e->env_rq_cpu)) {
+		spin_unlock(&rq->rq_lock);
+		return;
+	}
+	rq_unlink(rq, e);
+	spin_unlock(&rq->rq_lock);
+	if (e->env_status == ENV_RUNNABLE)
+		sched_enqueue(e);
+}
+
+// Set the time slice of priority level 'priority' to 'ticks' timer
+// ticks.  Returns 0 on success, -E_INVAL if either is out of range.
+int
+sched_set_slice(int priority, int ticks)
+{
+	if (priority < ENV_PRIO_MIN || priority > ENV_PRIO_MAX || ticks < 1)
+		return -E_INVAL;
+	sched_slices[PRIO_LEVEL(priority)] = ticks;
+	return 0;
+}
+
+// Print the time slice of every priority level.
+void
+sched_slice_print(void)
+{
+	int prio;
+
+	for (prio = ENV_PRIO_MAX; prio >= ENV_PRIO_MIN; prio--)
+		cprintf("priority %2d: %d tick%s\n", prio,
+			sched_slices[PRIO_LEVEL(prio)],
+			sched_slices[PRIO_LEVEL(prio)] == 1 ? "" : "s");
+}
+
+// Charge e for the time it spent in user mode since it last entered
+// it.  Called on every trap from user mode.
+void
+sched_account(struct Env *e)
+{
+	uint64_t now = read_tsc(), delta = now - e->env_exec_start;
+
+	e->env_exec_start = now;
+	e->env_runtime += delta;
+	if (e->env_sched_class == ENV_SCHED_FAIR)
+		e->env_vruntime += delta * WEIGHT_PRIO_MIN
+			/ sched_weights[e->priority - ENV_PRIO_MIN];
+}
+
+// Take the env that should run next on CPU 'cpu' off rq: the
+// highest-priority fixed-priority env, the one queued first among
+// equals, or else the fair env with the least virtual runtime.  Envs
+// whose affinity does not allow 'cpu' are passed over; that only
+// happens when stealing.  Stale entries met on the way are dropped.
+// Returns NULL if rq has no env runnable on 'cpu'.
+static struct Env *
+rq_pick(struct RunQueue *rq, int cpu)
+{
+	struct Env *e, *next;
+	uint32_t levels;
+	int i;
+
+	spin_lock(&rq->rq_lock);
+	for (levels = rq->rq_bitmap; levels; levels &= ~(1 << bsf(levels)))
+		for (e = rq->rq_levels[bsf(levels)].rl_head; e; e = next) {
+			next = e->env_rq_next;
+			if (e->env_status != ENV_RUNNABLE)
+				rq_unlink(rq, e);
+			else if (CPU_ALLOWED(e, cpu))
+				goto found;
+		}
+
+	while (rq->rq_nfair && rq->rq_fair[0]->env_status != ENV_RUNNABLE)
+		rq_unlink(rq, rq->rq_fair[0]);
+	e = NULL;
+	if (rq->rq_nfair && CPU_ALLOWED(rq->rq_fair[0], cpu))
+		e = rq->rq_fair[0];
+	else
+		for (i = 1; i < rq->rq_nfair; i++)
+			if (rq->rq_fair[i]->env_status == ENV_RUNNABLE
+			    && CPU_ALLOWED(rq->rq_fair[i], cpu)
+			    && (!e || rq->rq_fair[i]->env_vruntime < e->env_vruntime))
+				e = rq->rq_fair[i];
+	if (e == NULL) {
+		spin_unlock(&rq->rq_lock);
+		return NULL;
+	}
+
+found:
+	rq_unlink(rq, e);
+	if (e->env_sched_class == ENV_SCHED_FAIR)
+		rq->rq_min_vruntime = MAX(rq->rq_min_vruntime, e->env_vruntime);
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Steal a runnable env that may run on this CPU, trying the CPUs with
+// the longest run queues first.
+static struct Env *
+rq_steal(void)
+{
+	struct RunQueue *victim;
+	struct Env *e;
+	uint32_t tried = 1 << cpunum();
+	int i;
+
+	while (1) {
+		victim = NULL;
+		for (i = 0; i < ncpu; i++)
+			if (!(tried & (1 << i)) && runqueues[i].rq_len > 0
+			    && (!victim || runqueues[i].rq_len > victim->rq_len))
+				victim = &runqueues[i];
+		if (!victim)
+			return NULL;
+		if ((e = rq_pick(victim, cpunum())) != NULL)
+			return e;
+		tried |= 1 << (victim - runqueues);
+	}
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	if (sched_idle & (1 << cpunum()))
+		__sync_fetch_and_and(&sched_idle, ~(1 << cpunum()));
+
+	// Run the best env queued on this CPU.  If there is none,
+	// take one from a busier CPU before giving up.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
 	// choose that environment.
 	//
 	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	// found the next runnable env
-	int begin = curenv? ENVX(curenv->env_id): 0;
-	int next = (begin + 1) % NENV;
-	int runnable = begin;
-	for (; next != begin; next = (next + 1) % NENV) {
-		if (envs[next].env_status == ENV_RUNNABLE) {
-			if (envs[runnable].env_status != ENV_RUNNABLE ||
-			    // Challenge: a fixed-priority scheduler
-			    envs[next].priority > envs[runnable].priority) {
-				runnable = next;
-			}
-		}
+	// another CPU (env_status == ENV_RUNNING).  Such envs are never
+	// on a run queue.
+	if ((e = rq_pick(&runqueues[cpunum()], cpunum())) || (e = rq_steal())) {
+		e->env_slice = sched_slices[PRIO_LEVEL(e->priority)];
+		env_run(e);
+	}
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && CPU_ALLOWED(curenv, cpunum()))
+		env_run(curenv);
+
+	// sched_halt never returns
+	sched_halt();
+}
+
+// Give this CPU straight to e, an IPC partner that the caller has just
+// made ENV_RUNNABLE without queueing it, bypassing the run queues.  If
+// e may not run on this CPU, queue it and pick another env instead.
+void
+sched_direct(struct Env *e)
+{
+	if (CPU_ALLOWED(e, cpunum())) {
+		e->env_slice = sched_slices[PRIO_LEVEL(e->priority)];
+		env_run(e);
 	}
+	env_lock(e);
+	if (e->env_status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	env_unlock(e);
+	sched_yield();
+}
+
+// Set this CPU's timer to fire every tick.
+static void
+timer_periodic(struct RunQueue *rq)
+{
+	if (!rq->rq_periodic)
+		lapic_timer_periodic();
+	rq->rq_periodic = 1;
+	rq->rq_expire = 0;
+}
+
+// Set this CPU's timer to fire once at time 'expire', or never (0).
+static void
+timer_oneshot(struct RunQueue *rq, uint64_t expire)
+{
+	uint64_t now;
+
+	if (!rq->rq_periodic && expire == rq->rq_expire)
+		return;
+	if (expire) {
+		now = time_usec();
+		lapic_timer_oneshot(expire > now ? MIN(expire - now, 0xFFFFFFFF) : 1);
+	} else if (rq->rq_periodic || rq->rq_expire)
+		lapic_timer_oneshot(0);
+	rq->rq_periodic = 0;
+	rq->rq_expire = expire;
+}
+
+// The next timer wheel event if this CPU runs the wheel, else 0.
+static uint64_t
+timer_wheel_expire(void)
+{
+	return cpunum() == 0 ? timer_next : 0;
+}
+
+// Program this CPU's timer for curenv, which is about to return to
+// user mode.  'switched' says whether curenv just took over the CPU
+// and starts a new time slice.
+void
+sched_timer_arm(bool switched)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+	uint64_t expire, wheel, now = time_usec();
 
-	unsigned status = envs[runnable].env_status;
-	if (status == ENV_RUNNABLE || (curenv == &envs[runnable] && status == ENV_RUNNING)) {
-		env_run(&envs[runnable]);
+	if (switched)
+		rq->rq_slice_end = now + TICK_USEC *
+			(curenv->env_sched_class == ENV_SCHED_FIXED
+			 ? MAX(curenv->env_slice, 1) : 1);
+	if (!sched_tickless) {
+		timer_periodic(rq);
 		return;
 	}
 
-	// sched_halt never returns
-	sched_halt();
+	expire = 0;
+	if (rq->rq_len > 0) {
+		// Envs began waiting after curenv's slice ran out
+		if (rq->rq_slice_end <= now)
+			rq->rq_slice_end = now + TICK_USEC;
+		expire = rq->rq_slice_end;
+	}
+	if ((wheel = timer_wheel_expire()) && (!expire || wheel < expire))
+		expire = wheel;
+	timer_oneshot(rq, expire);
+}
+
+// Whether curenv should give up the CPU: a fixed-priority env when
+// its time slice is used up or a higher-priority env is waiting, a
+// fair env when any fixed-priority env or a fair env with less
+// virtual runtime is waiting, and any env whose affinity no longer
+// allows this CPU.  A slice within half a tick of its end counts as
+// used up, since timer interrupts may come in a little early.
+static bool
+sched_preempt(void)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+	bool keep = 0;
+
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && CPU_ALLOWED(curenv, cpunum())) {
+		spin_lock(&rq->rq_lock);
+		if (curenv->env_sched_class == ENV_SCHED_FIXED)
+			keep = time_usec() + TICK_USEC / 2 < rq->rq_slice_end
+				&& (!rq->rq_bitmap
+				    || bsf(rq->rq_bitmap) >= PRIO_LEVEL(curenv->priority));
+		else
+			keep = !rq->rq_bitmap
+				&& (!rq->rq_nfair
+				    || rq->rq_fair[0]->env_vruntime >= curenv->env_vruntime);
+		spin_unlock(&rq->rq_lock);
+	}
+	return !keep;
+}
+
+// Called on every timer interrupt.
+void
+sched_tick(void)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+
+	if (!rq->rq_periodic)
+		rq->rq_expire = 0;
+	if (cpunum() == 0)
+		timer_run();
+	if (sched_preempt())
+		sched_yield();
+}
+
+// Called on an IRQ_RESCHED IPI: an env was queued that may be better
+// than curenv, or that this CPU, if idle, may take.
+void
+sched_resched(void)
+{
+	if (sched_preempt())
+		sched_yield();
 }
 
 // Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// timer interrupt, or in tickless mode an IRQ_RESCHED IPI, wakes it
+// up. This function never returns.
 //
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Envs asleep on the timer wheel will be runnable again, so then
+	// halt as usual and let the wheel wake them.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && timer_next == 0) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	e = curenv;
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
+	if (e)
+		env_put(e);
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
-	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	// Use the idle time to zero some free pages ahead of
+	// page_alloc(ALLOC_ZERO).
+	page_zero_fill();
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Mark this CPU idle, then look at our queue once more: an env
+	// queued before the mark was visible got no IPI.
+	if (sched_tickless)
+		timer_oneshot(&runqueues[cpunum()], timer_wheel_expire());
+	else
+		timer_periodic(&runqueues[cpunum()]);
+	__sync_fetch_and_or(&sched_idle, 1 << cpunum());
+	if (runqueues[cpunum()].rq_len > 0)
+		sched_yield();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -6,7 +6,25 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+struct Env;
+
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_priority(struct Env *e, int priority);
+void sched_set_class(struct Env *e, unsigned sched_class);
+void sched_set_affinity(struct Env *e, uint32_t cpumask);
+void sched_account(struct Env *e);
+int sched_set_slice(int priority, int ticks);
+void sched_slice_print(void);
+void sched_tick(void);
+void sched_resched(void);
+void sched_timer_arm(bool switched);
+
+extern bool sched_tickless;
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_direct(struct Env *e) __attribute__((noreturn));
 
 #endif	// !JOS_KERN_SCHED_H
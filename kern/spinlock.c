@@ -9,47 +9,46 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
-get_caller_pcs(uint32_t pcs[])
+get_caller_pcs(uint32_t pcs[], int n)
 {
 	uint32_t *ebp;
 	int i;
 
 	ebp = (uint32_t *)read_ebp();
-	for (i = 0; i < 10; i++){
+	for (i = 0; i < n; i++){
 		if (ebp == 0 || ebp < (uint32_t *)ULIM)
 			break;
 		pcs[i] = ebp[1];          // saved %eip
 		ebp = (uint32_t *)ebp[0]; // saved %ebp
 	}
-	for (; i < 10; i++)
+	for (; i < n; i++)
 		pcs[i] = 0;
 }
+#endif
+
+#ifdef LOCKSTAT
+// Every lock that has ever been acquired, most recently used first.
+static struct spinlock *lockstat_list;
+#endif
 
+#ifdef DEBUG_SPINLOCK
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
 	lk->name = name;
-	lk->cpu = 0;
 #endif
 }
 
@@ -60,21 +59,55 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	unsigned ticket;
+#ifdef LOCKSTAT
+	uint64_t spin_start = 0, now;
+	struct spinlock *head;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The locked xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// reordered before it.
+	ticket = __sync_fetch_and_add(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef LOCKSTAT
+		spin_start = read_tsc();
+#endif
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+	}
+	// Keep gcc from moving the critical section above the loop.
+	asm volatile ("" ::: "memory");
+
+#ifdef LOCKSTAT
+	now = read_tsc();
+	lk->ls_acquires++;
+	if (spin_start) {
+		lk->ls_contended++;
+		lk->ls_spin += now - spin_start;
+	}
+	lk->ls_start = now;
+	// Not get_caller_pcs, whose first PC is its own return address
+	// here in spin_lock.
+	lk->ls_pc = (uintptr_t) __builtin_return_address(0);
+	if (!lk->ls_listed) {
+		lk->ls_listed = 1;
+		do {
+			head = lockstat_list;
+			lk->ls_next = head;
+		} while (!__sync_bool_compare_and_swap(&lockstat_list, head, lk));
+	}
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
-	get_caller_pcs(lk->pcs);
+	get_caller_pcs(lk->pcs, 10);
 #endif
 }
 
@@ -107,14 +140,107 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+#ifdef LOCKSTAT
+	uint64_t hold = read_tsc() - lk->ls_start;
+	lk->ls_hold += hold;
+	if (hold > lk->ls_max_hold) {
+		lk->ls_max_hold = hold;
+		lk->ls_max_hold_pc = lk->ls_pc;
+	}
+#endif
+
+	// Only the holder writes owner, so a plain increment hands the
+	// lock to the next ticket.  Intel 64 and IA-32 never move a
+	// store before earlier loads or stores, so the critical section
+	// cannot leak past it; the compiler barrier keeps gcc from
+	// moving it either.
+	asm volatile ("" ::: "memory");
+	lk->owner = lk->owner + 1;
 }
+
+#ifdef LOCKSTAT
+// Print the statistics of every lock that has been used, adding up
+// locks with the same name, such as the per-env locks.  Times are in
+// TSC cycles.
+void
+lockstat_print(void)
+{
+	struct spinlock *lk, *other;
+	uint64_t acquires, contended, spin, hold, max_hold;
+	uintptr_t max_hold_pc;
+	struct Eipdebuginfo info;
+	int nlocks;
+
+	cprintf("%-16s %5s %10s %10s %9s %9s %9s  %s\n", "lock", "count",
+		"acquires", "contended", "spin/acq", "hold/acq", "max hold",
+		"max hold at");
+	for (lk = lockstat_list; lk; lk = lk->ls_next) {
+		// Only the first lock with a name prints the line.
+		for (other = lockstat_list; other != lk; other = other->ls_next)
+			if (other->name == lk->name
+			    || (other->name && lk->name
+				&& strcmp(other->name, lk->name) == 0))
+				break;
+		if (other != lk)
+			continue;
+
+		nlocks = 0;
+		acquires = contended = spin = hold = max_hold = 0;
+		max_hold_pc = 0;
+		for (; other; other = other->ls_next) {
+			if (other->name != lk->name
+			    && (!other->name || !lk->name
+				|| strcmp(other->name, lk->name) != 0))
+				continue;
+			nlocks++;
+			acquires += other->ls_acquires;
+			contended += other->ls_contended;
+			spin += other->ls_spin;
+			hold += other->ls_hold;
+			if (other->ls_max_hold > max_hold) {
+				max_hold = other->ls_max_hold;
+				max_hold_pc = other->ls_max_hold_pc;
+			}
+		}
+		if (acquires == 0)
+			continue;
+
+		cprintf("%-16s %5d %10llu %10llu %9llu %9llu %9llu  ",
+			lk->name ? lk->name : "?", nlocks, acquires, contended,
+			contended ? spin / contended : 0ULL, hold / acquires,
+			max_hold);
+		if (debuginfo_eip(max_hold_pc, &info) >= 0)
+			cprintf("%.*s+%x\n", info.eip_fn_namelen,
+				info.eip_fn_name, max_hold_pc - info.eip_fn_addr);
+		else
+			cprintf("%08x\n", max_hold_pc);
+	}
+}
+
+// Clear the statistics.  Locks held meanwhile may still add to them.
+void
+lockstat_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = lockstat_list; lk; lk = lk->ls_next) {
+		lk->ls_acquires = 0;
+		lk->ls_contended = 0;
+		lk->ls_spin = 0;
+		lk->ls_hold = 0;
+		lk->ls_max_hold = 0;
+		lk->ls_max_hold_pc = 0;
+	}
+}
+#else
+void
+lockstat_print(void)
+{
+	cprintf("Lock statistics are off; define LOCKSTAT in kern/spinlock.h\n");
+}
+
+void
+lockstat_reset(void)
+{
+}
+#endif
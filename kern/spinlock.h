@@ -6,17 +6,41 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Uncomment this to keep lock statistics (see the lockstat monitor
+// command)
+// #define LOCKSTAT
+
 // Mutual exclusion lock.
+// A ticket lock: each CPU that wants the lock takes the next ticket
+// and waits for its number to come up, so CPUs get the lock in the
+// order they asked for it, and waiting CPUs only read the lock's cache
+// line until it is released.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile unsigned next;	// Next ticket to hand out
+	volatile unsigned owner;	// Ticket now holding the lock
 
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	char *name;            // Name of lock.
+#endif
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
+#ifdef LOCKSTAT
+	// Statistics, updated while the lock is held.
+	struct spinlock *ls_next;	// Next lock on the list of those used
+	unsigned ls_listed;	// Is the lock on that list?
+	uint64_t ls_acquires;	// Times acquired
+	uint64_t ls_contended;	// Times some other CPU held it
+	uint64_t ls_spin;	// Cycles spent waiting for it
+	uint64_t ls_hold;	// Cycles it was held
+	uint64_t ls_max_hold;	// Longest it was held, in cycles
+	uint64_t ls_start;	// When the current holder got it
+	uintptr_t ls_pc;	// Where the current holder got it
+	uintptr_t ls_max_hold_pc;	// Where the longest holder got it
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
@@ -25,24 +49,31 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+void lockstat_print(void);
+void lockstat_reset(void);
+
+// Lock order.
+//
+// There is no big kernel lock; each piece of shared kernel state has
+// its own lock.  A CPU holding one of these locks may only acquire
+// locks further down the list, so that no two CPUs ever wait for each
+// other:
+//
+//	env locks (kern/env.c), at most two, lower envs[] index first
+//	env_table_lock (kern/env.c)
+//	ipc_lock of any env slot (kern/ipc.c)
+//	futex_lock of any futex bucket (kern/futex.c)
+//	timer_lock (kern/timer.c)
+//	rq_lock of any run queue (kern/sched.c)
+//	rmap_lock (kern/pmap.c)
+//	kc_lock of any kmem cache, then kmem_lock (kern/kmem.c)
+//	page_zero_lock, page_depot_lock (kern/pmap.c)
+//	tlb_lock of any CPU (kern/pmap.c)
+//	e1000_lock (kern/e1000.c)
+//	printf_lock (kern/printf.c)
+//	cons_lock (kern/console.c)
+//
+// Kernel code runs with interrupts disabled, so per-CPU state needs no
+// lock at all.
 
 #endif
@@ -12,6 +12,9 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 #include <kern/e1000.h>
 
 // Print a string to the system console.
@@ -24,10 +27,13 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
+	// Hold our own lock so nobody unmaps the string meanwhile.
+	env_lock(curenv);
 	user_mem_assert(curenv, s, len, PTE_P | PTE_U);
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	env_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -56,7 +62,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
 	env_destroy(e);
 	return 0;
@@ -89,20 +95,164 @@ sys_exofork(void)
 		return r;
 	}
 
-	child->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc left the child ENV_NOT_RUNNABLE.
 	child->env_tf = curenv->env_tf;
+	child->env_affinity = curenv->env_affinity;
 	// return 0 in child process
 	child->env_tf.tf_regs.reg_eax = 0;
 	return child->env_id;
 }
 
+// Map the superpage 'pde' at 'va' of the parent into 'child' for
+// fork_copy.  There is no copy-on-write for superpages: shared and
+// read-only ones, and all of them if 'share', are mapped as they are,
+// and writable ones are copied right away.
+static int
+fork_superpage(struct Env *child, uintptr_t va, pde_t pde, bool share)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(pde)), *copy;
+	int perm = pde & PTE_SYSCALL;
+	int r;
+
+	if (share || (perm & PTE_SHARE) || !(perm & PTE_W))
+		return page_insert_large(child->env_pgdir, pp, (void *) va, perm);
+
+	if ((copy = page_alloc_order(PAGE_MAX_ORDER, 0)) == NULL)
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PTSIZE);
+	if ((r = page_insert_large(child->env_pgdir, copy, (void *) va, perm)) < 0)
+		page_free(copy);
+	return r;
+}
+
+// Give 'child' the parent's address space below UTOP, except for the
+// exception stack, in one pass over the parent's page tables.
+// PTE_SHARE pages are shared as they are.  Writable and copy-on-write
+// pages are mapped copy-on-write in the child, and the writable ones
+// become copy-on-write in the parent too.  Other pages are shared
+// read-only.
+// If 'share', all pages below USTACKBASE are shared as they are, after
+// breaking copy-on-write for them in the parent, so that both see the
+// same writes.  Only the stacks and the thread-local page above it are
+// copy-on-write.
+// The caller must hold both envs' locks.
+static int
+fork_copy(struct Env *parent, struct Env *child, bool share)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *pt, pte;
+	bool shared;
+	int perm, r = 0;
+
+	static_assert(UTOP % PTSIZE == 0);
+	tlb_batch_begin(parent->env_pgdir);
+	for (pdeno = 0; pdeno < PDX(UTOP) && r == 0; pdeno++) {
+		if (!(parent->env_pgdir[pdeno] & PTE_P))
+			continue;
+		va = (uintptr_t) PGADDR(pdeno, 0, 0);
+		if (parent->env_pgdir[pdeno] & PTE_PS) {
+			r = fork_superpage(child, va, parent->env_pgdir[pdeno],
+					   share && va < USTACKBASE);
+			continue;
+		}
+
+		pt = (pte_t *) KADDR(PTE_ADDR(parent->env_pgdir[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++, va += PGSIZE) {
+			pte = pt[pteno];
+			if (!(pte & PTE_P) || va == UXSTACKTOP - PGSIZE)
+				continue;
+			shared = (pte & PTE_SHARE) || (share && va < USTACKBASE);
+			if (shared && (pte & PTE_COW)) {
+				if ((r = page_cow_break(parent, (void *) va)) < 0)
+					break;
+				pte = pt[pteno];
+			}
+			perm = pte & PTE_SYSCALL;
+			if (!shared && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pte & PTE_W) {
+					pt[pteno] = (pte & ~PTE_W) | PTE_COW;
+					tlb_invalidate(parent->env_pgdir, (void *) va);
+				}
+			}
+			r = page_insert(child->env_pgdir, pa2page(PTE_ADDR(pte)),
+					(void *) va, perm);
+			if (r < 0)
+				break;
+		}
+	}
+	tlb_batch_end();
+	return r;
+}
+
+// Create a child environment that is a copy-on-write copy of the
+// current one, as fork in lib/fork.c describes, in a single system
+// call.  The child gets our registers (with sys_fork returning 0), our
+// page fault upcall and a fresh exception stack, and is made runnable.
+// Since our own writable pages are left copy-on-write as well, we must
+// have a page fault upcall to handle that.
+// If 'share', the child shares our memory below USTACKBASE instead, as
+// for sfork (see fork_copy).
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_INVAL if the current environment has no page fault upcall.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(bool share)
+{
+	struct Env *child;
+	struct PageInfo *pp;
+	envid_t envid;
+	int r;
+
+	if (curenv->env_pgfault_upcall == NULL) {
+		return -E_INVAL;
+	}
+	if ((r = env_alloc(&child, curenv->env_id)) < 0) {
+		return r;
+	}
+
+	env_lock2(curenv, child);
+	child->env_tf = curenv->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	child->env_affinity = curenv->env_affinity;
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	r = fork_copy(curenv, child, share);
+	if (r == 0) {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+			r = -E_NO_MEM;
+		} else if ((r = page_insert(child->env_pgdir, pp,
+					    (void *) (UXSTACKTOP - PGSIZE),
+					    PTE_P | PTE_U | PTE_W)) < 0) {
+			page_free(pp);
+		}
+	}
+	env_unlock(curenv);
+
+	if (r < 0) {
+		env_free(child);
+		return r;
+	}
+	envid = child->env_id;
+	child->env_status = ENV_RUNNABLE;
+	sched_enqueue(child);
+	env_unlock(child);
+	return envid;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
-// or ENV_NOT_RUNNABLE.
+// or ENV_NOT_RUNNABLE.  Making an environment that is running (on
+// this or another CPU) runnable does nothing.  Cancels any timeout
+// the environment was blocked with.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if status is ENV_NOT_RUNNABLE but envid is running.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -118,13 +268,25 @@ sys_env_set_status(envid_t envid, int status)
 	}
 
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	int r = envid2env_lock(envid, &e, 1);
 	if (r < 0) {
 		return r;
 	}
 
-	e->env_status = status;
-	return 0;
+	r = 0;
+	if (e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) {
+		if (status == ENV_NOT_RUNNABLE)
+			r = -E_INVAL;
+	} else {
+		timer_cancel(e);
+		futex_cancel(e);
+		ipc_queue_remove(e);
+		e->env_status = status;
+		if (status == ENV_RUNNABLE)
+			sched_enqueue(e);
+	}
+	env_unlock(e);
+	return r;
 }
 
 // Set envid's trap frame to 'tf'.
@@ -140,20 +302,19 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// LAB 5: Your code here.
 	// Remember to check whether the user has supplied us with a good
 	// address!
-	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	struct Env *self, *e;
+	int r = envid2env_lock2(0, &self, envid, &e, 1);
 	if (r < 0) {
 		return r;
 	}
 
-	r = user_mem_check(e, tf, sizeof(*tf), PTE_U);
-	if (r < 0) {
-		return r;
+	r = user_mem_check(self, tf, sizeof(*tf), PTE_U);
+	if (r == 0) {
+		assert((tf->tf_eflags & FL_IF) == FL_IF);
+		e->env_tf = *tf;
 	}
-	assert((tf->tf_eflags & FL_IF) == FL_IF);
-
-	e->env_tf = *tf;
-	return 0;
+	env_unlock2(self, e);
+	return r;
 }
 
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
@@ -169,11 +330,12 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	int r = envid2env_lock(envid, &e, 1);
 	if (r < 0) {
 		return r;
 	}
 	e->env_pgfault_upcall = func;
+	env_unlock(e);
 	return 0;
 }
 
@@ -212,13 +374,14 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	}
 
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	int r = envid2env_lock(envid, &e, 1);
 	if (r < 0) {
 		return r;
 	}
 
 	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
 	if (pp == NULL) {
+		env_unlock(e);
 		return -E_NO_MEM;
 	}
 
@@ -226,6 +389,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (r < 0) {
 		page_free(pp);
 	}
+	env_unlock(e);
 	return 0;
 }
 
@@ -244,6 +408,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is part of a superpage (see sys_page_map_large).
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -272,11 +437,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	// -E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
 	struct Env *srce;
 	struct Env *dste;
-	int r = envid2env(srcenvid, &srce, 1);
-	if (r < 0) {
-		return r;
-	}
-	r = envid2env(dstenvid, &dste, 1);
+	int r = envid2env_lock2(srcenvid, &srce, dstenvid, &dste, 1);
 	if (r < 0) {
 		return r;
 	}
@@ -285,16 +446,117 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	struct PageInfo *pp = page_lookup(srce->env_pgdir, srcva, &ppte);
 	// -E_INVAL if srcva is not mapped in srcenvid's address space.
 	if (pp == NULL) {
-		return -E_INVAL;
+		r = -E_INVAL;
+		goto out;
 	}
 	// -E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's address space.
 	if ((perm & PTE_W) == PTE_W && (*ppte & PTE_W) != PTE_W) {
-		return -E_INVAL;
+		r = -E_INVAL;
+		goto out;
+	}
+	// -E_INVAL if srcva is part of a superpage.
+	if ((*ppte & PTE_PS) == PTE_PS) {
+		r = -E_INVAL;
+		goto out;
 	}
 
 	// Map the page of memory at 'srcva' in srcenvid's address space
 	// at 'dstva' in dstenvid's address space with permission 'perm'.
-	return page_insert(dste->env_pgdir, pp, dstva, perm);
+	r = page_insert(dste->env_pgdir, pp, dstva, perm);
+out:
+	env_unlock2(srce, dste);
+	return r;
+}
+
+// Allocate a 4MB superpage and map it at 'va' in the address space of
+// 'envid' with a single PTE_PS page directory entry.
+// The superpage's contents are set to 0.
+// Anything already mapped in [va, va+PTSIZE) is unmapped as a side
+// effect.
+//
+// perm -- same as in sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not PTSIZE-aligned.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no free, physically contiguous 4MB block.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	if ((uintptr_t) va >= UTOP || ROUNDUP(va, PTSIZE) != va) {
+		return -E_INVAL;
+	}
+	if ((perm | PTE_AVAIL | PTE_W) != PTE_SYSCALL) {
+		return -E_INVAL;
+	}
+
+	struct Env *e;
+	int r = envid2env_lock(envid, &e, 1);
+	if (r < 0) {
+		return r;
+	}
+
+	struct PageInfo *pp = page_alloc_order(PAGE_MAX_ORDER, ALLOC_ZERO);
+	if (pp == NULL) {
+		env_unlock(e);
+		return -E_NO_MEM;
+	}
+
+	r = page_insert_large(e->env_pgdir, pp, va, perm);
+	if (r < 0) {
+		page_free(pp);
+	}
+	env_unlock(e);
+	return r;
+}
+
+// Map the superpage at 'srcva' in srcenvid's address space at 'dstva'
+// in dstenvid's address space with permission 'perm'.
+// Anything already mapped in [dstva, dstva+PTSIZE) is unmapped as a
+// side effect.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if srcva >= UTOP or srcva is not PTSIZE-aligned,
+//		or dstva >= UTOP or dstva is not PTSIZE-aligned.
+//	-E_INVAL if srcva is not mapped by a superpage in srcenvid's
+//		address space.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
+//		address space.
+static int
+sys_page_map_large(envid_t srcenvid, void *srcva,
+		   envid_t dstenvid, void *dstva, int perm)
+{
+	if (((uintptr_t) srcva >= UTOP || ROUNDUP(srcva, PTSIZE) != srcva) ||
+	    ((uintptr_t) dstva >= UTOP || ROUNDUP(dstva, PTSIZE) != dstva)) {
+		return -E_INVAL;
+	}
+	if (((perm | PTE_AVAIL | PTE_W) & PTE_SYSCALL) != PTE_SYSCALL) {
+		return -E_INVAL;
+	}
+
+	struct Env *srce;
+	struct Env *dste;
+	int r = envid2env_lock2(srcenvid, &srce, dstenvid, &dste, 1);
+	if (r < 0) {
+		return r;
+	}
+
+	pde_t pde = srce->env_pgdir[PDX(srcva)];
+	if ((pde & (PTE_PS | PTE_P)) != (PTE_PS | PTE_P)) {
+		r = -E_INVAL;
+	} else if ((perm & PTE_W) == PTE_W && (pde & PTE_W) != PTE_W) {
+		r = -E_INVAL;
+	} else {
+		r = page_insert_large(dste->env_pgdir, pa2page(PTE_ADDR(pde)),
+				      dstva, perm);
+	}
+	env_unlock2(srce, dste);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -315,18 +577,189 @@ sys_page_unmap(envid_t envid, void *va)
 	}
 
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+	int r = envid2env_lock(envid, &e, 1);
 	if (r < 0) {
 		return r;
 	}
 
 	page_remove(e->env_pgdir, va);
+	env_unlock(e);
 	return 0;
 }
 
+// Decode the page argument 'pages' of an IPC system call, which names
+// a run of pages as IPC_PAGES describes, into the run of *npages pages
+// at *va.  *npages is 0 if pages >= UTOP, meaning no pages.
+// Returns 0 on success, -E_INVAL if the run does not fit below UTOP.
+static int
+ipc_pages(void *pages, void **va, size_t *npages)
+{
+	*va = (void *) IPC_PAGES_VA(pages);
+	*npages = IPC_PAGES_N(pages);
+	if ((uintptr_t) pages >= UTOP)
+		*npages = 0;
+	else if (*npages > (UTOP - (uintptr_t) *va) / PGSIZE)
+		return -E_INVAL;
+	return 0;
+}
+
+// Make the page argument 'srcva' of a send, with 'perm', into a vector
+// of pages for ipc_deliver.  Returns the number of runs in *iv, 0 or 1,
+// or -E_INVAL as ipc_pages does.
+static int
+ipc_vec1(void *srcva, unsigned perm, struct IpcVec *iv)
+{
+	int r;
+
+	if ((r = ipc_pages(srcva, &iv->iv_va, &iv->iv_npages)) < 0)
+		return r;
+	iv->iv_perm = perm;
+	return iv->iv_npages ? 1 : 0;
+}
+
+// Check that 'from' may send the pages of the 'nvec' runs in 'vec', as
+// sys_ipc_try_send describes for a single page, and that there are at
+// most IPC_MAXPAGES of them.  Sets *npages to the number of pages.
+// The caller must hold from's lock.
+static int
+ipc_vec_check(struct Env *from, const struct IpcVec *vec, int nvec,
+	      size_t *npages)
+{
+	uintptr_t va;
+	pte_t *ppte;
+	size_t j;
+	int i;
+
+	*npages = 0;
+	for (i = 0; i < nvec; i++) {
+		va = (uintptr_t) vec[i].iv_va;
+		// -E_INVAL if the run is not page-aligned or not below UTOP,
+		// or there are too many pages.
+		if (va % PGSIZE || va >= UTOP || vec[i].iv_npages == 0
+		    || vec[i].iv_npages > IPC_MAXPAGES - *npages
+		    || vec[i].iv_npages > (UTOP - va) / PGSIZE)
+			return -E_INVAL;
+		// -E_INVAL if perm is inappropriate
+		if ((vec[i].iv_perm | PTE_AVAIL | PTE_W) != PTE_SYSCALL)
+			return -E_INVAL;
+		for (j = 0; j < vec[i].iv_npages; j++, va += PGSIZE) {
+			// -E_INVAL if the page is not mapped in the
+			// caller's address space.
+			if (!page_lookup(from->env_pgdir, (void *) va, &ppte))
+				return -E_INVAL;
+			// -E_INVAL if (perm & PTE_W), but the page is
+			// read-only in the caller's address space.
+			if ((vec[i].iv_perm & PTE_W) && !(*ppte & PTE_W))
+				return -E_INVAL;
+			// -E_INVAL if the page is part of a superpage.
+			if (*ppte & PTE_PS)
+				return -E_INVAL;
+		}
+		*npages += vec[i].iv_npages;
+	}
+	return 0;
+}
+
+// Map the pages of 'vec', which ipc_vec_check has passed, one after
+// another at to's env_ipc_dstva.  All or nothing: if a page cannot be
+// mapped, the pages mapped so far are unmapped again.
+// The caller must hold both envs' locks.
+static int
+ipc_map(struct Env *from, struct Env *to, const struct IpcVec *vec, int nvec)
+{
+	uint8_t *dst = to->env_ipc_dstva;
+	struct PageInfo *pp;
+	size_t j;
+	int i, r = 0;
+
+	tlb_batch_begin(to->env_pgdir);
+	for (i = 0; i < nvec && r == 0; i++)
+		for (j = 0; j < vec[i].iv_npages; j++, dst += PGSIZE) {
+			pp = page_lookup(from->env_pgdir,
+					 (uint8_t *) vec[i].iv_va + j * PGSIZE, NULL);
+			if ((r = page_insert(to->env_pgdir, pp, dst, vec[i].iv_perm)) < 0)
+				break;
+		}
+	if (r < 0)
+		while (dst > (uint8_t *) to->env_ipc_dstva) {
+			dst -= PGSIZE;
+			page_remove(to->env_pgdir, dst);
+		}
+	tlb_batch_end();
+	return r;
+}
+
+// Deliver a message from 'from' to 'to', which is receiving, and
+// update to's ipc fields as sys_ipc_try_send describes.  The pages of
+// the 'nvec' runs in 'vec' are mapped one after another in to's
+// receive window.  The caller makes 'to' runnable if it was blocked.
+// The caller must hold both envs' locks.
+static int
+ipc_deliver(struct Env *from, struct Env *to, uint32_t value,
+	    const struct IpcVec *vec, int nvec)
+{
+	size_t npages;
+	int r;
+
+	if ((r = ipc_vec_check(from, vec, nvec, &npages)) < 0)
+		return r;
+
+	to->env_ipc_perm = 0;
+	to->env_ipc_npages = 0;
+	// If the sender wants to send pages but the receiver isn't asking for any,
+	// then no page mapping is transferred, but no error occurs.
+	if (npages && to->env_ipc_dstpages) {
+		// -E_INVAL if they do not fit in the receive window
+		if (npages > to->env_ipc_dstpages)
+			return -E_INVAL;
+		// -E_NO_MEM if there's not enough memory to map them in envid's address space
+		if ((r = ipc_map(from, to, vec, nvec)) < 0)
+			return r;
+		to->env_ipc_perm = vec[0].iv_perm;
+		to->env_ipc_npages = npages;
+	}
+
+	to->env_ipc_recving = 0;
+	to->env_ipc_from = from->env_id;
+	to->env_ipc_value = value;
+	timer_cancel(to);
+	return 0;
+}
+
+// Whether 'to' is blocked receiving a message that 'from' may send:
+// from anyone in sys_ipc_recv, only from the callee in sys_ipc_call.
+static bool
+ipc_accepts(struct Env *to, struct Env *from)
+{
+	return to->env_ipc_recving
+		&& (!to->env_ipc_recv_from || to->env_ipc_recv_from == from->env_id);
+}
+
+// What the IPC system call 'to' is blocked in returns once a message
+// has been delivered to it: sys_ipc_call returns the value itself, to
+// save its caller a look at env_ipc_value; sys_ipc_recv returns 0.
+static int
+ipc_result(struct Env *to)
+{
+	return to->env_ipc_recv_from ? (int) to->env_ipc_value : 0;
+}
+
+// Make 'e', blocked in an IPC system call, runnable, with 'r' as the
+// return value of the call.
+// The caller must hold e's lock.
+static void
+ipc_wake(struct Env *e, int r)
+{
+	e->env_tf.tf_regs.reg_eax = r;
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If srcva names a run of pages (see IPC_PAGES in inc/env.h), send
+// them all; the receiver gets them one after another in its window.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -338,7 +771,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -353,75 +787,129 @@ sys_page_unmap(envid_t envid, void *va)
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but the pages do not fit below UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
+//	-E_INVAL if srcva < UTOP but a page is not mapped in the caller's
 //		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
+//	-E_INVAL if (perm & PTE_W), but a page is read-only in the
 //		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//	-E_INVAL if srcva < UTOP but a page is part of a superpage.
+//	-E_INVAL if there are more pages than envid's receive window holds.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
 //		address space.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *e;
-	int r = envid2env(envid, &e, 0);
+	struct Env *self;
+	struct IpcVec iv;
+	int nvec, r;
+
+	if ((nvec = ipc_vec1(srcva, perm, &iv)) < 0)
+		return nvec;
+	r = envid2env_lock2(0, &self, envid, &e, 0);
 	// -E_BAD_ENV if environment envid doesn't currently exist.
 	if (r < 0) {
 		return r;
 	}
 
 	// -E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-	if (!e->env_ipc_recving) {
-		return -E_IPC_NOT_RECV;
-	}
+	if (!ipc_accepts(e, self))
+		r = -E_IPC_NOT_RECV;
+	else if ((r = ipc_deliver(self, e, value, &iv, nvec)) == 0)
+		ipc_wake(e, ipc_result(e));
 
-	e->env_ipc_perm = 0;
+	env_unlock2(self, e);
+	return r;
+}
 
-	if ((uintptr_t) srcva < UTOP) {
-		// -E_INVAL if srcva < UTOP but srcva is not page-aligned.
-		if (ROUNDDOWN(srcva, PGSIZE) != srcva) {
-			return -E_INVAL;
-		}
-		// -E_INVAL if srcva < UTOP and perm is inappropriate
-		if ((perm | PTE_AVAIL | PTE_W) != PTE_SYSCALL) {
-			return -E_INVAL;
-		}
+// Send 'value' and the pages of 'vec' to 'envid', blocking on its
+// queue of senders until it receives them if it is not receiving.
+// The common part of sys_ipc_send and sys_ipc_send_vec.
+static int
+ipc_send_block(envid_t envid, uint32_t value, const struct IpcVec *vec,
+	       int nvec)
+{
+	struct Env *e, *self;
+	size_t npages;
+	int r;
 
-		pte_t *ppte;
-		struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, &ppte);
-		// -E_INVAL if srcva < UTOP but srcva is not mapped in the caller's address space.
-		if (pp == NULL) {
-			return -E_INVAL;
-		}
-		// -E_INVAL if (perm & PTE_W), but srcva is read-only in the
-		// current environment's address space.
-		if ((perm & PTE_W) == PTE_W && (*ppte & PTE_W) != PTE_W) {
-			return -E_INVAL;
-		}
+	if ((r = envid2env_lock2(0, &self, envid, &e, 0)) < 0)
+		return r;
 
-		// If the sender wants to send a page but the receiver isn't asking for one,
-		// then no page mapping is transferred, but no error occurs.
-		if ((uintptr_t) e->env_ipc_dstva < UTOP) {
-			// -E_NO_MEM if there's not enough memory to map srcva in envid's address space
-			r = page_insert(e->env_pgdir, pp, e->env_ipc_dstva, perm);
-			if (r < 0) {
-				return r;
-			}
-			e->env_ipc_perm = perm;
-		}
+	if (e == self)
+		r = -E_INVAL;
+	else if (ipc_accepts(e, self)) {
+		if ((r = ipc_deliver(self, e, value, vec, nvec)) == 0)
+			ipc_wake(e, ipc_result(e));
+	} else if ((r = ipc_vec_check(self, vec, nvec, &npages)) == 0) {
+		env_block(self, e);
+		self->env_ipc_send_value = value;
+		memmove(self->env_ipc_send_vec, vec, nvec * sizeof(*vec));
+		self->env_ipc_send_nvec = nvec;
+		self->env_ipc_recv_from = 0;
+		ipc_queue_add(e, self);
+		self->env_tf.tf_regs.reg_eax = 0;
+		// As in sys_ipc_recv
+		curenv = NULL;
+		pgdir_switch(kern_pgdir);
+		env_unlock2(self, e);
+		sched_yield();
 	}
 
-	e->env_ipc_recving = 0;
-	e->env_ipc_from = curenv->env_id;
-	e->env_ipc_value = value;
-	e->env_status = ENV_RUNNABLE;
-	// return value of receiver's `syscall`
-	e->env_tf.tf_regs.reg_eax = 0;
+	env_unlock2(self, e);
+	return r;
+}
 
-	return 0;
+// Send 'value' (and the pages at 'srcva') to 'envid' like
+// sys_ipc_try_send, but if envid is not blocked in sys_ipc_recv, block
+// on its queue of senders until it receives the message (see
+// kern/ipc.c).  The pages are mapped into the receiver when it does.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send except -E_IPC_NOT_RECV, and:
+//	-E_INVAL if envid is the caller.
+//	-E_BAD_ENV if envid exits before receiving the message.
+//	-E_INVAL or -E_NO_MEM if the pages can no longer be sent, or
+//		mapped, when envid receives them.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct IpcVec iv;
+	int nvec;
+
+	if ((nvec = ipc_vec1(srcva, perm, &iv)) < 0)
+		return nvec;
+	return ipc_send_block(envid, value, &iv, nvec);
+}
+
+// Send 'value' to 'envid' as sys_ipc_send does, together with the
+// pages of the 'nvec' runs described by the array 'vec': each run is
+// iv_npages pages starting at the page-aligned iv_va, mapped with
+// iv_perm.  The receiver gets all the pages one after another in its
+// receive window, or none of them if the send fails; its env_ipc_perm
+// is the perm of the first run.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_send, and:
+//	-E_INVAL if nvec is negative or more than IPC_MAXVEC, a run is
+//		empty, or there are more than IPC_MAXPAGES pages.
+static int
+sys_ipc_send_vec(envid_t envid, uint32_t value, const struct IpcVec *uvec,
+		 int nvec)
+{
+	struct IpcVec vec[IPC_MAXVEC];
+
+	if (nvec < 0 || nvec > IPC_MAXVEC)
+		return -E_INVAL;
+	// Hold our own lock so nobody unmaps the vector while we copy it.
+	env_lock(curenv);
+	user_mem_assert(curenv, uvec, nvec * sizeof(*uvec), PTE_P | PTE_U);
+	memmove(vec, uvec, nvec * sizeof(*uvec));
+	env_unlock(curenv);
+	return ipc_send_block(envid, value, vec, nvec);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -430,30 +918,279 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' names a run of pages (see IPC_PAGES in inc/env.h), that
+// run is the receive window: up to that many pages may be received,
+// mapped one after another from its start.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// If 'timeout' is not 0, give up after that many microseconds.
+//
+// If an env is blocked in sys_ipc_send to us, take its message at once
+// instead of blocking.
+//
+// This function only returns on error, or with a message from a
+// blocked sender, but the system call will eventually
+// return 0 on success, or -E_TIMEOUT if nothing was received in time.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but the window does not fit below UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint32_t timeout)
 {
 	// LAB 4: Your code here.
-	if ((uintptr_t) dstva < UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva) {
-		return -E_INVAL;
+	struct Env *e = curenv, *s;
+	size_t npages;
+	void *va;
+	int r;
+
+	if ((r = ipc_pages(dstva, &va, &npages)) < 0)
+		return r;
+
+	env_lock(e);
+	e->env_ipc_dstva = va;
+	e->env_ipc_dstpages = npages;
+	e->env_ipc_recv_from = 0;
+
+	// Take the message of the first env blocked in sys_ipc_send or
+	// sys_ipc_call to us, if there is one.  Senders whose message can
+	// no longer be delivered get the error instead.  A caller goes on
+	// to wait for our reply.
+	while ((s = ipc_queue_first(e)) != NULL) {
+		env_unlock(e);
+		env_lock2(e, s);
+		// Unless s stopped sending meanwhile
+		if (s->env_ipc_send_to == e->env_id && s->env_ipc_send_pprev) {
+			ipc_queue_remove(s);
+			r = ipc_deliver(s, e, s->env_ipc_send_value,
+					s->env_ipc_send_vec, s->env_ipc_send_nvec);
+			if (r == 0 && s->env_ipc_recv_from == e->env_id)
+				s->env_ipc_recving = 1;
+			else
+				ipc_wake(s, r);
+			if (r == 0) {
+				env_unlock2(e, s);
+				return 0;
+			}
+		}
+		env_unlock(s);
 	}
 
-	curenv->env_ipc_recving = 1;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	e->env_ipc_recving = 1;
+	env_block(e, NULL);
+	if (timeout)
+		timer_add(e, time_usec() + timeout);
+	// Once unlocked, a sender on another CPU may make us runnable and
+	// that CPU may run us, so let go of our address space first.
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+	env_unlock(e);
 
-	// Never return from `sys_yield` because `curenv->env_tf.tf_eip` is equal to
+	// Never return from `sched_yield` because `e->env_tf.tf_eip` is equal to
 	// the address of next line right behind `int $0x30` in `lib/syscall.c`
-	sys_yield();
+	sched_yield();
 
 	return 0;
 }
 
+// Send 'value' (and the pages at 'srcva') to 'envid' as sys_ipc_send
+// does, then wait for envid's reply alone, mapping any pages it sends
+// in the window 'dstva' as sys_ipc_recv does.  If envid was waiting for
+// the message, this CPU switches straight to it without going through
+// the scheduler, as sys_ipc_reply_wait does back.
+//
+// Returns the value of the reply, or < 0 on error.  Since servers
+// reply with negative error codes too, errors and replies can only be
+// told apart by env_ipc_from, which stays 0 on error.  Errors are those of
+// sys_ipc_send, and:
+//	-E_INVAL if dstva < UTOP but the window does not fit below UTOP.
+//	-E_BAD_ENV if envid exits before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *e, *self;
+	struct IpcVec iv;
+	size_t npages, dstpages;
+	void *va;
+	bool direct;
+	int nvec, r;
+
+	if ((r = ipc_pages(dstva, &va, &dstpages)) < 0)
+		return r;
+	if ((nvec = ipc_vec1(srcva, perm, &iv)) < 0)
+		return nvec;
+	if ((r = envid2env_lock2(0, &self, envid, &e, 0)) < 0)
+		return r;
+
+	self->env_ipc_from = 0;
+	self->env_ipc_perm = 0;
+	self->env_ipc_npages = 0;
+	if (e == self) {
+		r = -E_INVAL;
+		goto out;
+	}
+	// Before e can take the message, since we may not get to wake it
+	env_block(self, e);
+	if ((direct = ipc_accepts(e, self)))
+		r = ipc_deliver(self, e, value, &iv, nvec);
+	else
+		r = ipc_vec_check(self, &iv, nvec, &npages);
+	if (r < 0) {
+		self->env_status = ENV_RUNNING;
+		goto out;
+	}
+
+	self->env_ipc_dstva = va;
+	self->env_ipc_dstpages = dstpages;
+	self->env_ipc_recv_from = e->env_id;
+	if (direct) {
+		// e takes the message now; we wait for the reply
+		self->env_ipc_recving = 1;
+		e->env_tf.tf_regs.reg_eax = ipc_result(e);
+		e->env_status = ENV_RUNNABLE;
+	} else {
+		// e takes the message from its queue in sys_ipc_recv
+		self->env_ipc_send_value = value;
+		self->env_ipc_send_vec[0] = iv;
+		self->env_ipc_send_nvec = nvec;
+		ipc_queue_add(e, self);
+	}
+	// As in sys_ipc_recv
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+	env_unlock2(self, e);
+	if (direct)
+		sched_direct(e);
+	sched_yield();
+
+out:
+	env_unlock2(self, e);
+	return r;
+}
+
+// Reply 'value' (and the pages at 'srcva') to 'envid', which must be
+// blocked in sys_ipc_call to us or in sys_ipc_recv, then wait for the
+// next message as sys_ipc_recv(dstva) does.  Unless other messages are
+// queued for us already, this CPU switches straight to envid.  If
+// envid is 0, just wait.
+//
+// Returns 0 once a message has been received, or < 0 on error without
+// waiting.  Errors are those of sys_ipc_try_send and sys_ipc_recv.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+	struct Env *e, *self;
+	struct IpcVec iv;
+	size_t dstpages;
+	void *va;
+	int nvec, r;
+
+	if (envid == 0)
+		return sys_ipc_recv(dstva, 0);
+	if ((r = ipc_pages(dstva, &va, &dstpages)) < 0)
+		return r;
+	if ((nvec = ipc_vec1(srcva, perm, &iv)) < 0)
+		return nvec;
+	if ((r = envid2env_lock2(0, &self, envid, &e, 0)) < 0)
+		return r;
+
+	if (e == self || !ipc_accepts(e, self)) {
+		env_unlock2(self, e);
+		return -E_IPC_NOT_RECV;
+	}
+	// As in sys_ipc_call
+	env_block(self, e);
+	if ((r = ipc_deliver(self, e, value, &iv, nvec)) < 0) {
+		self->env_status = ENV_RUNNING;
+		env_unlock2(self, e);
+		return r;
+	}
+
+	if (ipc_queue_first(self)) {
+		// Serve the next request first, and leave e to the scheduler
+		self->env_status = ENV_RUNNING;
+		ipc_wake(e, ipc_result(e));
+		env_unlock2(self, e);
+		return sys_ipc_recv(dstva, 0);
+	}
+
+	self->env_ipc_recving = 1;
+	self->env_ipc_dstva = va;
+	self->env_ipc_dstpages = dstpages;
+	self->env_ipc_recv_from = 0;
+	e->env_tf.tf_regs.reg_eax = ipc_result(e);
+	e->env_status = ENV_RUNNABLE;
+	// As in sys_ipc_recv
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+	env_unlock2(self, e);
+	sched_direct(e);
+}
+
+// Block for 'usec' microseconds.  Like sys_ipc_recv, this returns
+// only once the timer wheel makes the environment runnable again, or
+// someone else does with sys_env_set_status.
+static int
+sys_sleep(uint32_t usec)
+{
+	struct Env *e = curenv;
+
+	env_lock(e);
+	e->env_tf.tf_regs.reg_eax = 0;
+	env_block(e, NULL);
+	timer_add(e, time_usec() + usec);
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+	env_unlock(e);
+
+	sched_yield();
+}
+
+// Block while the 32-bit word at 'addr' holds 'expected', until
+// sys_futex_wake is called on the same word, possibly through another
+// mapping of its page.  If 'usec' is not 0, give up after that many
+// microseconds.
+//
+// Returns 0 once woken (or made runnable by sys_env_set_status),
+// < 0 on error.  Errors are:
+//	-E_AGAIN if the word does not hold 'expected'.
+//	-E_TIMEOUT if the wait timed out.
+//	-E_INVAL if addr is not 4-byte aligned.
+//	-E_FAULT if addr is not readable by the caller.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, uint32_t usec)
+{
+	struct Env *e = curenv;
+	int r;
+
+	env_lock(e);
+	if ((r = futex_wait(e, (uintptr_t) addr, expected, usec)) < 0) {
+		env_unlock(e);
+		return r;
+	}
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+	env_unlock(e);
+
+	sched_yield();
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait on the word
+// at 'addr'.
+// Returns the number woken, or < 0 on error as for sys_futex_wait.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t pa;
+	int r;
+
+	env_lock(curenv);
+	r = futex_key(curenv, (uintptr_t) addr, &pa);
+	env_unlock(curenv);
+	if (r < 0)
+		return r;
+	return futex_wake(pa, n);
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -462,9 +1199,191 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Store the time since boot at *t, in microseconds or nanoseconds.
+// These do not fit the 32-bit return value.
+// Destroys the environment on memory errors.
+static void
+sys_time_store(uint64_t *t, uint64_t now)
+{
+	env_lock(curenv);
+	user_mem_assert(curenv, t, sizeof(*t), PTE_W);
+	*t = now;
+	env_unlock(curenv);
+}
+
+static int
+sys_time_usec(uint64_t *usec)
+{
+	sys_time_store(usec, time_usec());
+	return 0;
+}
+
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+	sys_time_store(nsec, time_nsec());
+	return 0;
+}
+
 // Challenge: a fixed-priority scheduler
-void sys_env_set_priority(int priority) {
-	curenv->priority = priority;
+// Returns 0 on success, -E_INVAL if priority is not between
+// ENV_PRIO_MIN and ENV_PRIO_MAX.
+int sys_env_set_priority(int priority) {
+	if (priority < ENV_PRIO_MIN || priority > ENV_PRIO_MAX)
+		return -E_INVAL;
+	env_lock(curenv);
+	env_set_priority(curenv, priority);
+	env_unlock(curenv);
+	return 0;
+}
+
+// Move the current environment to scheduling class sched_class,
+// ENV_SCHED_FAIR or ENV_SCHED_FIXED.
+// Returns 0 on success, -E_INVAL if sched_class is neither.
+static int
+sys_env_set_sched_class(int sched_class)
+{
+	if (sched_class != ENV_SCHED_FAIR && sched_class != ENV_SCHED_FIXED)
+		return -E_INVAL;
+	env_lock(curenv);
+	sched_set_class(curenv, sched_class);
+	env_unlock(curenv);
+	return 0;
+}
+
+// Restrict envid to the CPUs in cpumask, bit i standing for CPU i.
+// Bits for CPUs that do not exist are ignored.  An environment left
+// running on a CPU it may no longer use, this one or another, moves
+// right away.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains no existing CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *e;
+	int r;
+
+	if (ncpu < 32)
+		cpumask &= (1 << ncpu) - 1;
+	if (cpumask == 0)
+		return -E_INVAL;
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
+		return r;
+	sched_set_affinity(e, cpumask);
+	env_unlock(e);
+
+	if (e == curenv && !(cpumask & (1 << cpunum()))) {
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+	return 0;
+}
+
+// Register the page at 'va' as the current environment's syscall ring
+// (see inc/syscall.h), replacing any ring it had.  If va is NULL, drop
+// the ring.  The page need not be mapped until sys_ring_enter.
+//
+// Returns 0 on success, -E_INVAL if va is not page-aligned or not
+// below UTOP.
+static int
+sys_ring_setup(void *va)
+{
+	if ((uintptr_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	env_lock(curenv);
+	curenv->env_ring = va;
+	env_unlock(curenv);
+	return 0;
+}
+
+// Run one call taken from a syscall ring.  Only calls that never block
+// or switch environments are allowed.
+static int
+ring_dispatch(const struct SysSqe *sqe)
+{
+	const uint32_t *a = sqe->sqe_args;
+
+	switch (sqe->sqe_num) {
+	case SYS_page_alloc:
+		return sys_page_alloc((envid_t) a[0], (void *) a[1], a[2]);
+	case SYS_page_map:
+		return sys_page_map((envid_t) a[0], (void *) a[1],
+				    (envid_t) a[2], (void *) a[3], a[4]);
+	case SYS_page_unmap:
+		return sys_page_unmap((envid_t) a[0], (void *) a[1]);
+	case SYS_env_set_status:
+		return sys_env_set_status((envid_t) a[0], a[1]);
+	case SYS_env_set_pgfault_upcall:
+		return sys_env_set_pgfault_upcall(a[0], (void *) a[1]);
+	case SYS_ipc_try_send:
+		return sys_ipc_try_send(a[0], a[1], (void *) a[2], a[3]);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Run the calls queued in the current environment's syscall ring, in
+// order, posting each one's return value in the completion queue.
+// Stops early if the completion queue fills up.  The ring page is
+// accessed through the kernel mapping and held while the calls run, so
+// the calls may remap or unmap it.  TLB shootdowns for the environment's
+// own mappings are sent once for the whole batch.
+//
+// Returns the number of calls run, or < 0 on error.  Errors are:
+//	-E_INVAL if the environment has no syscall ring.
+//	-E_FAULT if the ring page is not mapped writable.
+static int
+sys_ring_enter(void)
+{
+	struct Env *e = curenv;
+	struct PageInfo *pp = NULL;
+	struct SysRing *ring;
+	struct SysSqe sqe;
+	uint32_t head, tail, ctail;
+	pte_t *pte;
+	int r, n = 0;
+
+	env_lock(e);
+	if (!e->env_ring)
+		r = -E_INVAL;
+	else if (!(pp = page_lookup(e->env_pgdir, e->env_ring, &pte))
+		 || (*pte & (PTE_W | PTE_U | PTE_PS)) != (PTE_W | PTE_U))
+		r = -E_FAULT;
+	else {
+		__sync_add_and_fetch(&pp->pp_ref, 1);
+		r = 0;
+	}
+	env_unlock(e);
+	if (r < 0)
+		return r;
+
+	ring = page2kva(pp);
+	head = ring->sr_sq_head;
+	tail = ring->sr_sq_tail;
+	ctail = ring->sr_cq_tail;
+	// The env may have moved its tail past what the queue holds
+	if (tail - head > SYSRING_NSQ)
+		tail = head + SYSRING_NSQ;
+
+	tlb_batch_begin(e->env_pgdir);
+	while (head != tail && ctail - ring->sr_cq_head < SYSRING_NCQ) {
+		// Copied, so the env cannot change it under us
+		sqe = ring->sr_sq[head % SYSRING_NSQ];
+		ring->sr_cq[ctail % SYSRING_NCQ].cqe_data = sqe.sqe_data;
+		ring->sr_cq[ctail % SYSRING_NCQ].cqe_result = ring_dispatch(&sqe);
+		head++;
+		ctail++;
+		n++;
+	}
+	tlb_batch_end();
+
+	ring->sr_sq_head = head;
+	ring->sr_cq_tail = ctail;
+	page_decref(pp);
+	return n;
 }
 
 int sys_send_data_at(void *addr, uint16_t len) {
@@ -509,20 +1428,51 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return 0;
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send(a1, a2, (void *) a3, a4);
+	case SYS_ipc_send:
+		return sys_ipc_send(a1, a2, (void *) a3, a4);
+	case SYS_ipc_send_vec:
+		return sys_ipc_send_vec(a1, a2, (const struct IpcVec *) a3, a4);
+	case SYS_ring_setup:
+		return sys_ring_setup((void *) a1);
+	case SYS_ring_enter:
+		return sys_ring_enter();
+	case SYS_fork:
+		return sys_fork(a1);
+	case SYS_ipc_call:
+		return sys_ipc_call(a1, a2, (void *) a3, a4, (void *) a5);
+	case SYS_ipc_reply_wait:
+		return sys_ipc_reply_wait(a1, a2, (void *) a3, a4, (void *) a5);
 	case SYS_ipc_recv:
-		return sys_ipc_recv((void *) a1);
+		return sys_ipc_recv((void *) a1, a2);
 	// Challenge: a fixed-priority scheduler
 	case SYS_env_set_priority:
-		sys_env_set_priority(a1);
-		return 0;
+		return sys_env_set_priority(a1);
+	case SYS_env_set_sched_class:
+		return sys_env_set_sched_class(a1);
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity((envid_t) a1, a2);
 	case SYS_env_set_trapframe:
 		return sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
 	case SYS_time_msec:
 		return sys_time_msec();
+	case SYS_time_usec:
+		return sys_time_usec((uint64_t *) a1);
+	case SYS_time_nsec:
+		return sys_time_nsec((uint64_t *) a1);
+	case SYS_sleep:
+		return sys_sleep(a1);
+	case SYS_futex_wait:
+		return sys_futex_wait((uint32_t *) a1, a2, a3);
+	case SYS_futex_wake:
+		return sys_futex_wake((uint32_t *) a1, a2);
 	case SYS_send_data_at:
 		return sys_send_data_at((void *) a1, a2);
 	case SYS_recv_data_at:
 		return sys_recv_data_at((void *) a1, a2, (struct recv_res *) a3);
+	case SYS_page_alloc_large:
+		return sys_page_alloc_large((envid_t) a1, (void *) a2, a3);
+	case SYS_page_map_large:
+		return sys_page_map_large((envid_t) a1, (void *) a2, (envid_t) a3, (void *) a4, a5);
 	default:
 		return -E_INVAL;
 	}
@@ -1,26 +1,49 @@
 #include <kern/time.h>
+#include <inc/x86.h>
 #include <inc/assert.h>
 
-static unsigned int ticks;
+// Time is told from the TSC, whose frequency lapic_init measures
+// against the PIT at boot, rather than by counting timer interrupts,
+// which do not come in at a steady rate in tickless mode.  This
+// assumes the TSCs of all CPUs tick in step, as they do on any CPU
+// with an invariant TSC and in QEMU.
+
+static uint64_t boot_tsc;
+static uint64_t tsc_hz = 1000000000;	// Until calibrated
 
 void
 time_init(void)
 {
-	ticks = 0;
+	boot_tsc = read_tsc();
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
 void
-time_tick(void)
+time_calibrate(uint64_t hz)
+{
+	assert(hz > 0);
+	tsc_hz = hz;
+}
+
+// Nanoseconds since boot.
+uint64_t
+time_nsec(void)
+{
+	uint64_t cycles = read_tsc() - boot_tsc;
+
+	// Split the cycles into whole seconds and the rest, so that
+	// the multiplication cannot overflow.
+	return cycles / tsc_hz * 1000000000
+		+ cycles % tsc_hz * 1000000000 / tsc_hz;
+}
+
+uint64_t
+time_usec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return time_nsec() / 1000;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
 }
@@ -4,8 +4,15 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+// Length of a timer tick
+#define TICK_USEC	10000
+
 void time_init(void);
-void time_tick(void);
+void time_calibrate(uint64_t tsc_hz);
+uint64_t time_nsec(void);
+uint64_t time_usec(void);
 unsigned int time_msec(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -0,0 +1,264 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+
+// Hierarchical timer wheel.
+//
+// Envs blocked with a timeout (sys_sleep, sys_ipc_recv, sys_futex_wait)
+// sit in the wheel until their wheel tick comes.  Level L has
+// WHEEL_SIZE slots of WHEEL_SIZE^L wheel ticks each.  An env whose
+// tick is less than WHEEL_SIZE slots of some level ahead goes in the
+// lowest such level; when the wheel reaches the start of a slot at
+// level L > 0, the slot's envs are cascaded into lower levels, and the
+// envs in a level 0 slot are woken when its tick comes.  So adding,
+// cancelling and expiring timers takes constant time however many are
+// pending.
+//
+// CPU 0 runs the wheel from its timer interrupt, and in tickless mode
+// arms its timer for timer_next.  The wheel is not stepped one tick
+// at a time: timer_run jumps straight to the next slot that needs
+// work, so an idle wheel costs nothing.
+//
+// An env's env_timer* fields are protected by timer_lock; env_timer
+// is only set or cleared with the env's lock held as well.
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+// Envs woken per pass of timer_run, which wakes them after dropping
+// timer_lock since env locks come first in the lock order.
+#define WAKE_BATCH	16
+
+static struct spinlock timer_lock = {
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+	.name = "timer_lock"
+#endif
+};
+
+static struct Env *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_now;		// First wheel tick not yet run
+static int wheel_count;			// Envs in the wheel
+
+volatile uint64_t timer_next;
+
+void
+timer_init(void)
+{
+	wheel_now = time_usec() / WHEEL_TICK_USEC;
+}
+
+static inline uint64_t
+level_slot(int level, uint64_t tick)
+{
+	return tick >> (level * WHEEL_BITS);
+}
+
+// Put e in the slot for its tick.  The caller must hold timer_lock.
+static void
+wheel_insert(struct Env *e)
+{
+	struct Env **slot;
+	uint64_t tick = MAX(e->env_timer, wheel_now);
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (level_slot(level, tick) - level_slot(level, wheel_now) < WHEEL_SIZE)
+			break;
+	// Beyond the top level: park it in the farthest slot, and it
+	// is placed again when that slot is cascaded.
+	if (level_slot(level, tick) - level_slot(level, wheel_now) >= WHEEL_SIZE)
+		tick = (level_slot(level, wheel_now) + WHEEL_SIZE - 1)
+			<< (level * WHEEL_BITS);
+
+	slot = &wheel[level][level_slot(level, tick) % WHEEL_SIZE];
+	e->env_timer_next = *slot;
+	if (*slot)
+		(*slot)->env_timer_pprev = &e->env_timer_next;
+	*slot = e;
+	e->env_timer_pprev = slot;
+}
+
+// Take e out of its slot.  The caller must hold timer_lock.
+static void
+wheel_remove(struct Env *e)
+{
+	*e->env_timer_pprev = e->env_timer_next;
+	if (e->env_timer_next)
+		e->env_timer_next->env_timer_pprev = e->env_timer_pprev;
+	e->env_timer_next = NULL;
+	e->env_timer_pprev = NULL;
+}
+
+// The first wheel tick, not before wheel_now, at which a level 0 slot
+// expires or a slot of a higher level cascades, or ~0 if the wheel is
+// empty.  The caller must hold timer_lock.
+static uint64_t
+wheel_next(void)
+{
+	uint64_t next = ~0ULL, tick, unit;
+	int level, i;
+
+	if (wheel_count == 0)
+		return next;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unit = 1ULL << (level * WHEEL_BITS);
+		tick = (wheel_now + unit - 1) & ~(unit - 1);
+		for (i = 0; i < WHEEL_SIZE && tick < next; i++, tick += unit)
+			if (wheel[level][level_slot(level, tick) % WHEEL_SIZE]) {
+				next = tick;
+				break;
+			}
+	}
+	return next;
+}
+
+// Run wheel tick 'tick', the first one with work to do: cascade the
+// higher level slots starting there, then take out up to 'max' envs
+// due at it into 'woken'.  The tick is done once its level 0 slot is
+// empty.  Returns the number of envs taken out.  The caller must hold
+// timer_lock.
+static int
+wheel_expire(uint64_t tick, struct Env **woken, int max)
+{
+	struct Env *e, *next, **slot;
+	int level, n = 0;
+
+	wheel_now = tick;
+	// Highest level first, so envs can fall through several levels
+	for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+		if (tick & ((1ULL << (level * WHEEL_BITS)) - 1))
+			continue;
+		slot = &wheel[level][level_slot(level, tick) % WHEEL_SIZE];
+		e = *slot;
+		*slot = NULL;
+		for (; e; e = next) {
+			next = e->env_timer_next;
+			wheel_insert(e);
+		}
+	}
+
+	slot = &wheel[0][tick % WHEEL_SIZE];
+	while ((e = *slot) && n < max) {
+		wheel_remove(e);
+		wheel_count--;
+		woken[n++] = e;
+	}
+	if (!*slot)
+		wheel_now = tick + 1;
+	return n;
+}
+
+static void
+timer_update_next(void)
+{
+	uint64_t tick = wheel_next();
+
+	timer_next = tick == ~0ULL ? 0 : MAX(tick, 1) * WHEEL_TICK_USEC;
+}
+
+// Wake e at time 'expire' (usec since boot) unless the timer is
+// cancelled first.  Replaces any timer e already has.
+// The caller must hold e's lock.
+void
+timer_add(struct Env *e, uint64_t expire)
+{
+	uint64_t old;
+
+	spin_lock(&timer_lock);
+	if (e->env_timer_pprev) {
+		wheel_remove(e);
+		wheel_count--;
+	}
+	e->env_timer = MAX((expire + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC, 1);
+	wheel_insert(e);
+	wheel_count++;
+	old = timer_next;
+	timer_update_next();
+	spin_unlock(&timer_lock);
+
+	// CPU 0 may be asleep with its timer armed for later
+	if (sched_tickless && cpunum() != 0 && (!old || timer_next < old))
+		lapic_ipi_cpu(cpus[0].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Cancel e's timer, if it has one.  Leaves timer_next alone, which
+// can only make CPU 0 wake up for nothing.
+// The caller must hold e's lock.
+void
+timer_cancel(struct Env *e)
+{
+	if (!e->env_timer)
+		return;
+	spin_lock(&timer_lock);
+	if (e->env_timer_pprev) {
+		wheel_remove(e);
+		wheel_count--;
+	}
+	spin_unlock(&timer_lock);
+	e->env_timer = 0;
+}
+
+// Wake e if its timer is still due: the timer was not cancelled or
+// replaced after timer_run took e out of the wheel.  A receive or
+// futex wait that times out returns -E_TIMEOUT.
+static void
+timer_wake(struct Env *e, uint64_t tick)
+{
+	env_lock(e);
+	if (e->env_timer && e->env_timer <= tick && !e->env_timer_pprev
+	    && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_timer = 0;
+		if (e->env_ipc_recving) {
+			e->env_ipc_recving = 0;
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		}
+		if (e->env_futex) {
+			futex_cancel(e);
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+		}
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	}
+	env_unlock(e);
+}
+
+// Wake the envs whose timers have expired.  Called by CPU 0 on every
+// timer interrupt.
+void
+timer_run(void)
+{
+	struct Env *woken[WAKE_BATCH];
+	uint64_t now, tick;
+	int i, n;
+
+	if (!timer_next || timer_next > (now = time_usec()))
+		return;
+	now /= WHEEL_TICK_USEC;
+
+	do {
+		n = 0;
+		spin_lock(&timer_lock);
+		while (n < WAKE_BATCH) {
+			if ((tick = wheel_next()) > now) {
+				// Nothing due before then
+				wheel_now = MIN(tick, now + 1);
+				break;
+			}
+			n += wheel_expire(tick, woken + n, WAKE_BATCH - n);
+		}
+		timer_update_next();
+		spin_unlock(&timer_lock);
+
+		for (i = 0; i < n; i++)
+			timer_wake(woken[i], now);
+	} while (n == WAKE_BATCH);
+}
@@ -0,0 +1,23 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// Resolution of the timer wheel
+#define WHEEL_TICK_USEC	1000
+
+void timer_init(void);
+void timer_add(struct Env *e, uint64_t expire);
+void timer_cancel(struct Env *e);
+void timer_run(void);
+
+// When the earliest timer expires, in usec since boot, or 0 if there
+// are none.  May be early, never late.
+extern volatile uint64_t timer_next;
+
+#endif	// !JOS_KERN_TIMER_H
@@ -63,6 +63,10 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_TLB)
+		return "TLB shootdown";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule";
 	return "(unknown trap)";
 }
 
@@ -98,6 +102,8 @@ trap_init(void)
 	void irq_spurious();
 	void irq_ide();
 	void irq_error();
+	void irq_tlb();
+	void irq_resched();
 
 	// SETGATE(gate, istrap, sel, off, dpl)
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, trap_divide, 0);
@@ -127,6 +133,8 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irq_spurious, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, irq_ide, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irq_error, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, irq_tlb, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, irq_resched, 0);
 
 	// Per-CPU setup
 	trap_init_percpu();
@@ -272,8 +280,11 @@ trap_dispatch(struct Trapframe *tf)
 		break;
 	case (IRQ_OFFSET + IRQ_TIMER):
 		lapic_eoi();
-		time_tick();
-		sched_yield();
+		sched_tick();
+		break;
+	case (IRQ_OFFSET + IRQ_RESCHED):
+		lapic_eoi();
+		sched_resched();
 		break;
 	case (IRQ_OFFSET + IRQ_KBD):
 		kbd_intr();
@@ -287,6 +298,7 @@ trap_dispatch(struct Trapframe *tf)
 		if (tf->tf_cs == GD_KT) {
 			panic("trap_dispatch failed: unhandled trap in kernel");
 		} else {
+			env_lock(curenv);
 			env_destroy(curenv);
 		}
 	}
@@ -304,10 +316,20 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Leaving user mode: stop other CPUs from waiting on us for TLB
+	// shootdowns, and carry out the ones already posted.
+	if ((tf->tf_cs & 3) == 3)
+		tlb_user_leave();
+
+	// That is all a shootdown IPI asks for.  Handle it right away,
+	// without taking any locks the sending CPU may be holding.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		if ((tf->tf_cs & 3) == 3)
+			tlb_user_enter();
+		env_pop_tf(tf);
+	}
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -315,14 +337,15 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
+		// There is no big kernel lock to take: each piece of
+		// kernel state has its own lock (see kern/spinlock.h).
 		// LAB 4: Your code here.
 		assert(curenv);
-		lock_kernel();
+		sched_account(curenv);
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
+			env_lock(curenv);
 			env_free(curenv);
 			curenv = NULL;
 			sched_yield();
@@ -371,6 +394,16 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Copy-on-write faults are resolved right here, without the upcall
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+		env_lock(curenv);
+		int r = page_cow_break(curenv, (void *) fault_va);
+		env_unlock(curenv);
+		if (r == 0) {
+			return;
+		}
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -402,6 +435,9 @@ page_fault_handler(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	uintptr_t esp = tf->tf_esp;
 
+	// Hold our own lock so nobody unmaps the exception stack while
+	// we write to it.
+	env_lock(curenv);
 	if ((curenv->env_pgfault_upcall == NULL)
 	    // (USTACKTOP, UXSTACKTOP - PGSIZE)
 	    || (UXSTACKTOP - PGSIZE > esp && esp > USTACKTOP)) {
@@ -434,5 +470,6 @@ page_fault_handler(struct Trapframe *tf)
 
 	tf->tf_esp = exception_stack_bottom;
 	tf->tf_eip = (uintptr_t) curenv->env_pgfault_upcall;
+	env_unlock(curenv);
 	env_run(curenv);
 }
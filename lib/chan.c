@@ -0,0 +1,183 @@
+// Channels: single-producer, single-consumer message rings in shared
+// memory.
+//
+// A channel is CHAN_NPAGES PTE_SHARE pages: a struct ChanRing, then a
+// data area.  The producer copies each message into the data area,
+// fills in the descriptor at cr_tail and then moves cr_tail on; the
+// consumer copies the message out and then moves cr_head on.  Each
+// side writes only its own fields, so there are no locks, just fences.
+// A message is kept in one piece: one that would run past the end of
+// the data area starts over at its beginning instead.
+//
+// Neither side makes a system call as long as the other keeps up.  A
+// side that has to wait sleeps in sys_futex_wait on the other side's
+// count, after setting a flag that asks to be woken, as pipes do.  The
+// producer rings that doorbell only when the ring goes from empty to
+// non-empty with the consumer asleep, and the consumer only when it
+// makes room for a producer that is asleep.
+//
+// Fork shares the pages, so a channel created before fork connects the
+// parent and the child.  Otherwise, send the pages with
+// IPC_PAGES(va, CHAN_NPAGES) and PTE_SHARE, and have the peer
+// chan_attach them.  Either way, both sides must have the channel
+// before it is used, since a channel with one side is closed.
+
+#include <inc/lib.h>
+
+// A peer that closes the channel wakes the other side; one that is
+// killed does not, so sleeps are cut short after a while to check.
+#define CHAN_WAIT_USEC	10000
+
+// Create a channel on the CHAN_NPAGES pages starting at 'va', which
+// must be page-aligned and unused.
+// Returns 0 on success, < 0 on error.
+int
+chan_create(struct Chan *c, void *va)
+{
+	int i, r;
+
+	static_assert(sizeof(struct ChanRing) <= PGSIZE);
+	static_assert(CHAN_NPAGES <= IPC_MAXPAGES);
+	static_assert((CHAN_DATASIZE & (CHAN_DATASIZE - 1)) == 0);
+
+	for (i = 0; i < CHAN_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (uint8_t *) va + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0) {
+			while (--i >= 0)
+				sys_page_unmap(0, (uint8_t *) va + i * PGSIZE);
+			return r;
+		}
+	chan_attach(c, va);
+	return 0;
+}
+
+// Use the channel whose pages are mapped at 'va'.
+void
+chan_attach(struct Chan *c, void *va)
+{
+	c->ch_ring = va;
+	c->ch_data = (uint8_t *) va + PGSIZE;
+}
+
+// Whether the other side has closed the channel or gone away.
+bool
+chan_isclosed(struct Chan *c)
+{
+	return c->ch_ring->cr_closed || pageref(c->ch_ring) < 2;
+}
+
+// Sleep until *count moves on from 'val' or the channel is closed.
+static void
+chan_wait(struct Chan *c, volatile uint32_t *count, uint32_t val,
+	  volatile uint32_t *waiting)
+{
+	*waiting = 1;
+	// Pairs with the fence in chan_wake: either the other side sees
+	// our flag, or we see its new count (or its close).
+	__sync_synchronize();
+	if (chan_isclosed(c))
+		return;
+	sys_futex_wait(count, val, CHAN_WAIT_USEC);
+}
+
+// Wake the other side if it waits for *count to move, after moving it.
+static void
+chan_wake(volatile uint32_t *count, volatile uint32_t *waiting)
+{
+	__sync_synchronize();
+	if (*waiting) {
+		*waiting = 0;
+		sys_futex_wake(count, 1);
+	}
+}
+
+// Send the 'len' bytes at 'buf' as one message, waiting for room if
+// the channel is full.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if len is more than CHAN_DATASIZE.
+//	-E_EOF if the channel is closed.
+int
+chan_send(struct Chan *c, const void *buf, size_t len)
+{
+	struct ChanRing *r = c->ch_ring;
+	uint32_t tail = r->cr_tail, head, pos;
+
+	if (len > CHAN_DATASIZE)
+		return -E_INVAL;
+
+	while (1) {
+		if (chan_isclosed(c))
+			return -E_EOF;
+		head = r->cr_head;
+		pos = r->cr_dtail;
+		if (pos % CHAN_DATASIZE + len > CHAN_DATASIZE)
+			pos += CHAN_DATASIZE - pos % CHAN_DATASIZE;
+		// Room for a descriptor, and for the data without
+		// reaching the oldest message still in the ring
+		if (tail == head)
+			break;
+		if (tail - head < CHAN_NDESC
+		    && pos + len - r->cr_desc[head % CHAN_NDESC].cd_pos <= CHAN_DATASIZE)
+			break;
+		chan_wait(c, &r->cr_head, head, &r->cr_pwait);
+	}
+
+	memmove(c->ch_data + pos % CHAN_DATASIZE, buf, len);
+	r->cr_desc[tail % CHAN_NDESC].cd_pos = pos;
+	r->cr_desc[tail % CHAN_NDESC].cd_len = len;
+	r->cr_dtail = pos + len;
+	// The message must be there before the consumer sees it
+	__sync_synchronize();
+	r->cr_tail = tail + 1;
+	// Not only when the ring was empty: without chan_wake's fence our
+	// read of cr_head could pass the store above and miss a consumer
+	// that took the last message and went to sleep.
+	chan_wake(&r->cr_tail, &r->cr_cwait);
+	return 0;
+}
+
+// Receive the next message into 'buf', waiting for one if the channel
+// is empty.  At most 'len' bytes are copied; the rest of a longer
+// message is dropped.
+// Returns the number of bytes copied, or < 0 on error.  Errors are:
+//	-E_EOF if the channel is empty and closed.
+ssize_t
+chan_recv(struct Chan *c, void *buf, size_t len)
+{
+	struct ChanRing *r = c->ch_ring;
+	uint32_t head = r->cr_head, tail;
+	struct ChanDesc *d;
+
+	while ((tail = r->cr_tail) == head) {
+		if (chan_isclosed(c))
+			return -E_EOF;
+		chan_wait(c, &r->cr_tail, tail, &r->cr_cwait);
+	}
+
+	// Read the message only after seeing cr_tail move past it
+	__sync_synchronize();
+	d = &r->cr_desc[head % CHAN_NDESC];
+	len = MIN(len, d->cd_len);
+	memmove(buf, c->ch_data + d->cd_pos % CHAN_DATASIZE, len);
+	// And be done with it before the producer reuses its space
+	__sync_synchronize();
+	r->cr_head = head + 1;
+	chan_wake(&r->cr_head, &r->cr_pwait);
+	return len;
+}
+
+// Close the channel, waking the other side, and unmap it.  Messages
+// already sent can still be received.
+void
+chan_close(struct Chan *c)
+{
+	struct ChanRing *r = c->ch_ring;
+	int i;
+
+	r->cr_closed = 1;
+	__sync_synchronize();
+	sys_futex_wake(&r->cr_tail, 1);
+	sys_futex_wake(&r->cr_head, 1);
+	for (i = CHAN_NPAGES - 1; i >= 0; i--)
+		sys_page_unmap(0, (uint8_t *) r + i * PGSIZE);
+}
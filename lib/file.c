@@ -6,11 +6,16 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Receive window for the block cache pages of FSREQ_READ_MAP replies,
+// just below the file descriptor table (see lib/fd.c)
+#define READWIN		(0xD0000000 - FSREAD_MAXPAGES * PGSIZE)
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
-// dstva: virtual address at which to receive reply page, 0 if none.
+// dstva: virtual address at which to receive reply page, 0 if none,
+//	or a window for several made with IPC_PAGES.
 // Returns result from the file server.
 static int
 fsipc(unsigned type, void *dstva)
@@ -24,8 +29,7 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -104,6 +108,8 @@ devfile_flush(struct Fd *fd)
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
+// Reads of more than a page have the file server map the block cache
+// pages holding the data into READWIN, and copy it from there.
 //
 // Returns:
 // 	The number of bytes successfully read.
@@ -116,8 +122,20 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	int r;
+	off_t off = fd->fd_offset;
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	if (n > PGSIZE) {
+		fsipcbuf.read.req_n = MIN(n, FSREAD_MAXPAGES * PGSIZE);
+		r = fsipc(FSREQ_READ_MAP, IPC_PAGES(READWIN, FSREAD_MAXPAGES));
+		if (r < 0)
+			return r;
+		assert(r <= n);
+		assert(off % PGSIZE + r <= thisenv->env_ipc_npages * PGSIZE);
+		memmove(buf, (char *) READWIN + off % PGSIZE, r);
+		return r;
+	}
+
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
 		return r;
@@ -5,13 +5,14 @@
 
 // TODO: why could we access PTEs though `uvpt`?
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// PTE_COW marks copy-on-write page table entries (see inc/mmu.h).
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// The kernel resolves copy-on-write faults itself (page_cow_break in
+// kern/pmap.c), so this only sees the ones it could not, such as when
+// it ran out of memory.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -68,131 +69,70 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	// LAB 4: Your code here.
-	pte_t pte = uvpt[pn];
-	void *va = (void *) (pn * PGSIZE);
-	int perm = pte & PTE_SYSCALL;
-
-	// use macro like a lambda function :P
-#define SYS_PAGE_MAP(src_env_id, dst_env_id, va, perm) do { \
-	    int r = sys_page_map(src_env_id, va, dst_env_id, va, perm); \
-	    if (r < 0) { \
-		    panic("duppage failed: sys_page_map(0x%x, %p, 0x%x, %p, 0x%x)", \
-			  src_env_id, va, dst_env_id, va, perm); \
-	    } \
-	} while (0)
-
-	if ((perm & PTE_SHARE) == PTE_SHARE) {
-		perm = PTE_SHARE | PTE_W | PTE_U | PTE_P;
-		SYS_PAGE_MAP(thisenv->env_id, envid, va, perm);
-	} else if ((perm & PTE_W) == PTE_W || (perm & PTE_COW) == PTE_COW) {
-		// the permission must be the below,
-		// cannot be `perm = perm | PTE_COW`
-		perm = PTE_COW | PTE_U | PTE_P;
-		// order is important
-		SYS_PAGE_MAP(thisenv->env_id, envid, va, perm);
-		SYS_PAGE_MAP(thisenv->env_id, thisenv->env_id, va, perm);
-	} else {
-		SYS_PAGE_MAP(thisenv->env_id, envid, va, perm);
-	}
-	return 0;
-}
-
-//
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then have sys_fork
+// create a child with a copy-on-write copy of our address space and
+// our page fault handler setup, already runnable.  The kernel does in
+// one pass over our page tables what used to take a sys_page_map or
+// two per page from here.
+// If 'share', the child shares our memory instead, as sfork describes.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
 // Hint:
-//   Use uvpd, uvpt, and duppage.
 //   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
 //
-envid_t
-pfork(int priority)
+static envid_t
+fork_as(int sched_class, int priority, bool share)
 {
 	// LAB 4: Your code here.
 
-	// Set up page fault handler
+	// Set up page fault handler, for the copy-on-write pages of
+	// both of us.  The child inherits the upcall.
 	set_pgfault_handler(pgfault);
 
-	// Create a child.
-	envid_t envid = sys_exofork();
-	// child env will pause here util father env be freed,
-	// because we don't have a auto scheduler currently
+	envid_t envid = sys_fork(share);
 	if (envid < 0) {
-		panic("fork failed: sys_exofork failed");
+		panic("fork failed: sys_fork: %e", envid);
 	}
 
-	int r;
 	// child
 	if (envid == 0) {
 		thisenv = &envs[ENVX(sys_getenvid())];
 		// Challenge: a fixed-priority scheduler
+		sys_env_set_sched_class(sched_class);
 		sys_env_set_priority(priority);
 		// cannot use `set_pgfault_handler(pgfault)` here,
 		// because the static variable will cause a page fault
-	} else {
-		uintptr_t p;
-		// minus one page to skip exception stack page
-		for (p = 0; p < UTOP - PGSIZE; p += PGSIZE) {
-			int pdx = PDX(p);
-			int pgnum = PGNUM(p);
-			// check permission to avoid page fault
-			if ((uvpd[pdx] & PTE_P) == PTE_P && (uvpt[pgnum] & PTE_P) == PTE_P) {
-				duppage(envid, pgnum);
-			}
-		}
-
-		// alloc the exception stack to the child.
-		int r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P);
-		if (r < 0) {
-			panic("fork failed: sys_page_alloc failed");
-		}
-		// page fault handler setup to the child.
-		r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall);
-		if (r < 0) {
-			panic("fork failed: sys_env_set_pgfault_upcall failed");
-		}
-		// mark the child as runnable
-		r = sys_env_set_status(envid, ENV_RUNNABLE);
-		if (r < 0) {
-			panic("fork failed: sys_env_set_status failed");
-		}
 	}
 
 	return envid;
 }
 
+// Fork a child that runs in the fixed-priority scheduling class,
+// ahead of all fair-share envs.
+envid_t
+pfork(int priority)
+{
+	return fork_as(ENV_SCHED_FIXED, priority, 0);
+}
+
 envid_t
 fork(void)
 {
-	return pfork(0);
+	return fork_as(ENV_SCHED_FAIR, ENV_PRIO_MIN, 0);
 }
 
 // Challenge!
-int
+// Fork a child that shares all our memory with us, except for the
+// stacks and the thread-local page from USTACKBASE up, which it gets
+// copy-on-write copies of.  Each has a thisenv of its own, since that
+// lives in the thread-local page.
+// Only pages mapped at the time are shared: a page either of us maps
+// later is its own.
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	return fork_as(ENV_SCHED_FAIR, ENV_PRIO_MIN, 1);
 }
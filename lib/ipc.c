@@ -4,7 +4,8 @@
 
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
-//	that address.
+//	that address.  'pg' may also name a window of several pages made
+//	with IPC_PAGES; thisenv->env_ipc_npages tells how many arrived.
 // If 'from_env_store' is nonnull, then store the IPC sender's envid in
 //	*from_env_store.
 // If 'perm_store' is nonnull, then store the IPC sender's page permission
@@ -21,11 +22,20 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_timeout(from_env_store, pg, perm_store, 0);
+}
+
+// Like ipc_recv, but return -E_TIMEOUT if nothing arrives within
+// 'usec' microseconds.  A usec of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+		 uint32_t usec)
 {
 	// LAB 4: Your code here.
 	pg = pg? pg: (void *) UTOP;
 
-	int r = sys_ipc_recv(pg);
+	int r = sys_ipc_recv_timeout(pg, usec);
 	if (from_env_store) {
 		*from_env_store = r? 0: thisenv->env_ipc_from;
 	}
@@ -37,12 +47,11 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until the receiver takes the
+// message, and panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -50,17 +59,72 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	// LAB 4: Your code here.
 	pg = pg? pg: (void *) UTOP;
 
-	int r = 1;
-	while (r) {
-		r = sys_ipc_try_send(to_env, val, pg, perm);
-		if (r) {
-			if (r == -E_IPC_NOT_RECV) {
-				sys_yield();
-			} else {
-				panic("ipc_send failed: %e", r);
-			}
-		}
+	int r = sys_ipc_send(to_env, val, pg, perm);
+	if (r < 0)
+		panic("ipc_send failed: %e", r);
+}
+
+// Send 'val' and the pages of the 'nvec' runs in 'vec' to 'to_env',
+// which gets them one after another in its receive window.  Blocks and
+// panics like ipc_send.
+void
+ipc_send_vec(envid_t to_env, uint32_t val, const struct IpcVec *vec, int nvec)
+{
+	int r = sys_ipc_send_vec(to_env, val, vec, nvec);
+	if (r < 0)
+		panic("ipc_send_vec failed: %e", r);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, as a remote procedure call.  Any page in the
+// reply is mapped at 'rcv_pg', if nonnull, and its permission stored
+// in *perm_store as for ipc_recv.
+// Returns the value of the reply, or < 0 on error.  Like ipc_send,
+// panics if the message cannot be sent, unless to_env is gone.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	pg = pg? pg: (void *) UTOP;
+	rcv_pg = rcv_pg? rcv_pg: (void *) UTOP;
+
+	r = sys_ipc_call(to_env, val, pg, perm, rcv_pg);
+	if (r < 0 && r != -E_BAD_ENV && thisenv->env_ipc_from != to_env)
+		panic("ipc_call failed: %e", r);
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return r;
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then receive the next message as ipc_recv does.  A server loops on
+// this, replying to one call as it takes the next.  Does not reply if
+// to_env is 0.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	pg = pg? pg: (void *) UTOP;
+	rcv_pg = rcv_pg? rcv_pg: (void *) UTOP;
+
+	r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
+	if (r < 0 && to_env) {
+		// A client that used ipc_send and ipc_recv may not have
+		// got to its ipc_recv yet.  Any other failure means the
+		// client is gone, and only the wait is left to do.
+		if (r == -E_IPC_NOT_RECV)
+			sys_ipc_send(to_env, val, pg, perm);
+		r = sys_ipc_reply_wait(0, 0, (void *) UTOP, 0, rcv_pg);
 	}
+	if (from_env_store)
+		*from_env_store = r? 0: thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = r? 0: thisenv->env_ipc_perm;
+	return r? r: thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -6,27 +6,43 @@
 
 // Virtual address at which to receive page mappings containing client requests.
 #define REQVA		0x0ffff000
-union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
+
+// nsipcbuf, followed by the pages that carry the data of large sends
+// and receives on past its end
+static union Nsipc nsipcpages[NSIPC_MAXPAGES] __attribute__((aligned(PGSIZE)));
+#define nsipcbuf	(nsipcpages[0])
+
+// Largest send and receive
+#define NSIPC_MAXSEND	(sizeof(nsipcpages) - offsetof(struct Nsreq_send, req_buf))
+#define NSIPC_MAXRECV	(sizeof(nsipcpages) - offsetof(struct Nsret_recv, ret_buf))
 
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
+// may be written back to nsipcbuf.  The first 'npages' pages of
+// nsipcpages go along, all in one IPC.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc_pages(unsigned type, int npages)
 {
 	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
+	static_assert(NSIPC_MAXPAGES <= IPC_MAXPAGES);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, IPC_PAGES(nsipcpages, npages),
+			PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+static int
+nsipc(unsigned type)
+{
+	return nsipc_pages(type, 1);
 }
 
 int
@@ -88,14 +104,22 @@ nsipc_listen(int s, int backlog)
 int
 nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
-	int r;
+	int r, i, npages;
+
+	len = MIN(len, NSIPC_MAXRECV);
+	npages = ROUNDUP(offsetof(struct Nsret_recv, ret_buf) + len, PGSIZE) / PGSIZE;
+	npages = MAX(npages, 1);
+	// The server writes into the pages, so they must be ours alone
+	// rather than copy-on-write after a fork
+	for (i = 1; i < npages; i++)
+		*(volatile char *) &nsipcpages[i] = 0;
 
 	nsipcbuf.recv.req_s = s;
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+	if ((r = nsipc_pages(NSREQ_RECV, npages)) >= 0) {
+		assert(r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
 
@@ -105,12 +129,16 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
+	int npages;
+
+	// Like write, send is allowed to send fewer bytes than asked
+	size = MIN(size, NSIPC_MAXSEND);
+	npages = ROUNDUP(offsetof(struct Nsreq_send, req_buf) + size, PGSIZE) / PGSIZE;
 	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc_pages(NSREQ_SEND, npages);
 }
 
 int
@@ -7,6 +7,8 @@ pageref(void *v)
 
 	if (!(uvpd[PDX(v)] & PTE_P))
 		return 0;
+	if (uvpd[PDX(v)] & PTE_PS)
+		return pages[PGNUM(uvpd[PDX(v)])].pp_ref;
 	pte = uvpt[PGNUM(v)];
 	if (!(pte & PTE_P))
 		return 0;
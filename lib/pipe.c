@@ -19,9 +19,18 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// A reader or writer that has to wait sleeps in sys_futex_wait on the
+// other side's position, after setting a flag that tells the other
+// side to wake it.  Only a peer that closes the pipe wakes it too; one
+// that is killed does not, so sleeps are cut short after a while to
+// check for that.
+#define PIPE_WAIT_USEC	10000
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwait;	// A reader may be waiting on p_wpos
+	uint32_t p_wwait;	// A writer may be waiting on p_rpos
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -101,12 +110,38 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until *pos moves on from 'val' or the pipe is closed.
+static void
+pipe_wait(struct Fd *fd, struct Pipe *p, volatile off_t *pos, off_t val,
+	  volatile uint32_t *waiting)
+{
+	*waiting = 1;
+	// Pairs with the fence in pipe_wake: either the other side sees
+	// our flag, or we see its new position (or its close).
+	__sync_synchronize();
+	if (_pipeisclosed(fd, p))
+		return;
+	sys_futex_wait((volatile uint32_t *) pos, val, PIPE_WAIT_USEC);
+}
+
+// Wake whoever waits for *pos to move, after moving it or closing.
+static void
+pipe_wake(volatile off_t *pos, volatile uint32_t *waiting)
+{
+	__sync_synchronize();
+	if (*waiting) {
+		*waiting = 0;
+		sys_futex_wake((volatile uint32_t *) pos, NENV);
+	}
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
 	struct Pipe *p;
+	off_t wpos;
 
 	p = (struct Pipe*)fd2data(fd);
 	if (debug)
@@ -115,24 +150,27 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		while (p->p_rpos == (wpos = p->p_wpos)) {
 			// pipe is empty
 			// if we got any data, return it
-			if (i > 0)
+			if (i > 0) {
+				pipe_wake(&p->p_rpos, &p->p_wwait);
 				return i;
+			}
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer comes along
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(fd, p, &p->p_wpos, wpos, &p->p_rwait);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+	pipe_wake(&p->p_rpos, &p->p_wwait);
 	return i;
 }
 
@@ -142,6 +180,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 	const uint8_t *buf;
 	size_t i;
 	struct Pipe *p;
+	off_t rpos;
 
 	p = (struct Pipe*) fd2data(fd);
 	if (debug)
@@ -150,17 +189,19 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+		while (p->p_wpos >= (rpos = p->p_rpos) + sizeof(p->p_buf)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the readers at what we wrote,
+			// and sleep until they make room
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(&p->p_wpos, &p->p_rwait);
+			pipe_wait(fd, p, &p->p_rpos, rpos, &p->p_wwait);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +209,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(&p->p_wpos, &p->p_rwait);
 	return i;
 }
 
@@ -185,7 +227,12 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	// Let anyone waiting on the other end see that we are gone
+	pipe_wake(&p->p_rpos, &p->p_wwait);
+	pipe_wake(&p->p_wpos, &p->p_rwait);
+	return sys_page_unmap(0, p);
 }
 
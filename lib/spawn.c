@@ -305,6 +305,19 @@ copy_shared_pages(envid_t child)
 	for (p = 0; p < UTOP; p += PGSIZE) {
 		int pdx = PDX(p);
 		int pgnum = PGNUM(p);
+		// a superpage has no page table to look at
+		if ((uvpd[pdx] & PTE_PS) == PTE_PS) {
+			if ((uvpd[pdx] & PTE_SHARE) == PTE_SHARE) {
+				int perm = PTE_SHARE | PTE_W | PTE_U | PTE_P;
+				int r = sys_page_map_large(0, (void *) p, child, (void *) p, perm);
+				if (r < 0) {
+					panic("copy_shared_pages failed: sys_page_map_large(0x%x, %p, 0x%x, %p, 0x%x)",
+					      0, p, child, p, perm);
+				}
+			}
+			p += PTSIZE - PGSIZE;
+			continue;
+		}
 		// check permission to avoid page fault
 		if ((uvpd[pdx] & PTE_P) == PTE_P &&
 		    (uvpt[pgnum] & PTE_P) == PTE_P &&
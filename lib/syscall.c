@@ -85,6 +85,18 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_page_map_large(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	return syscall(SYS_page_map_large, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -111,10 +123,82 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_send_vec(envid_t envid, uint32_t value, const struct IpcVec *vec,
+		 int nvec)
+{
+	return syscall(SYS_ipc_send_vec, 0, envid, value, (uint32_t) vec, nvec, 0);
+}
+
+int
+sys_ring_setup(struct SysRing *ring)
+{
+	return syscall(SYS_ring_setup, 0, (uint32_t) ring, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(void)
+{
+	return syscall(SYS_ring_enter, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_fork(bool share)
+{
+	return syscall(SYS_fork, 0, share, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva,
+		       perm, (uint32_t) dstva);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return sys_ipc_recv_timeout(dstva, 0);
+}
+
+// Like sys_ipc_recv, but give up with -E_TIMEOUT after 'usec'
+// microseconds, unless usec is 0.
+int
+sys_ipc_recv_timeout(void *dstva, uint32_t usec)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, usec, 0, 0, 0);
+}
+
+int
+sys_sleep(uint32_t usec)
+{
+	return syscall(SYS_sleep, 0, usec, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t usec)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, usec, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
 }
 
 unsigned int
@@ -123,9 +207,39 @@ sys_time_msec(void)
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+uint64_t
+sys_time_usec(void)
+{
+	uint64_t usec;
+
+	syscall(SYS_time_usec, 0, (uint32_t) &usec, 0, 0, 0, 0);
+	return usec;
+}
+
+uint64_t
+sys_time_nsec(void)
+{
+	uint64_t nsec;
+
+	syscall(SYS_time_nsec, 0, (uint32_t) &nsec, 0, 0, 0, 0);
+	return nsec;
+}
+
 // Challenge: a fixed-priority scheduler
-void sys_env_set_priority(int priority) {
-	syscall(SYS_env_set_priority, 0, priority, 0, 0, 0, 0);
+int sys_env_set_priority(int priority) {
+	return syscall(SYS_env_set_priority, 0, priority, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_sched_class(int sched_class)
+{
+	return syscall(SYS_env_set_sched_class, 0, sched_class, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
 }
 
 int sys_send_data_at(void *addr, uint16_t len) {
@@ -0,0 +1,107 @@
+// Batched system calls through a syscall ring (see inc/syscall.h).
+//
+// sysring_queue queues a call instead of making it, and sysring_flush
+// has the kernel run everything queued in as few sys_ring_enter calls
+// as it takes.  A full submission queue is flushed on the spot.  Calls
+// run in the order they were queued, but only at the next flush, so a
+// caller that needs a result before going on must flush first.
+//
+// Each env needs a ring of its own, so a child of fork sets one up
+// afresh the first time it queues a call.
+
+#include <inc/lib.h>
+
+static struct SysRing sysring __attribute__((aligned(PGSIZE)));
+static envid_t sysring_env;		// Env the ring is registered for
+
+// First failed call since the last sysring_flush
+static int sysring_error;
+static uint32_t sysring_error_data;
+
+static int
+sysring_init(void)
+{
+	int r;
+
+	static_assert(sizeof(sysring) <= PGSIZE);
+	memset(&sysring, 0, sizeof(sysring));
+	if ((r = sys_ring_setup(&sysring)) < 0)
+		return r;
+	sysring_env = thisenv->env_id;
+	sysring_error = 0;
+	return 0;
+}
+
+// Run the queued calls and take their results, remembering the first
+// failure.
+static int
+sysring_enter(void)
+{
+	struct SysCqe *cqe;
+	int r;
+
+	while (sysring.sr_sq_head != sysring.sr_sq_tail) {
+		if ((r = sys_ring_enter()) < 0)
+			return r;
+		for (; sysring.sr_cq_head != sysring.sr_cq_tail; sysring.sr_cq_head++) {
+			cqe = &sysring.sr_cq[sysring.sr_cq_head % SYSRING_NCQ];
+			if (cqe->cqe_result < 0 && !sysring_error) {
+				sysring_error = cqe->cqe_result;
+				sysring_error_data = cqe->cqe_data;
+			}
+		}
+	}
+	return 0;
+}
+
+// Queue system call 'num' with arguments a1 to a5.  'data' identifies
+// the call if it fails; see sysring_flush.  Only the calls the kernel
+// accepts in a ring may be queued: page alloc, map and unmap,
+// env_set_status, env_set_pgfault_upcall and ipc_try_send.
+// Returns 0 on success, < 0 if the ring cannot be set up or run.
+int
+sysring_queue(uint32_t data, uint32_t num, uint32_t a1, uint32_t a2,
+	      uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SysSqe *sqe;
+	int r;
+
+	if (sysring_env != thisenv->env_id && (r = sysring_init()) < 0)
+		return r;
+	if (sysring.sr_sq_tail - sysring.sr_sq_head == SYSRING_NSQ
+	    && (r = sysring_enter()) < 0)
+		return r;
+
+	sqe = &sysring.sr_sq[sysring.sr_sq_tail % SYSRING_NSQ];
+	sqe->sqe_num = num;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	sqe->sqe_data = data;
+	sysring.sr_sq_tail++;
+	return 0;
+}
+
+// Run all queued calls.
+// Returns 0 if they all succeeded.  Otherwise returns the error of the
+// first one that failed since the last flush, storing its 'data' in
+// *data_store if data_store is not NULL, or the error of
+// sys_ring_enter.
+int
+sysring_flush(uint32_t *data_store)
+{
+	int r;
+
+	if (sysring_env != thisenv->env_id)
+		return 0;
+	if ((r = sysring_enter()) < 0)
+		return r;
+	if ((r = sysring_error) < 0) {
+		sysring_error = 0;
+		if (data_store)
+			*data_store = sysring_error_data;
+	}
+	return r;
+}
@@ -0,0 +1,148 @@
+// User-level threads.
+//
+// A thread is an environment made with sfork, so it shares the memory
+// of the thread that created it, but has stacks and a thisenv of its
+// own, and can run on another CPU.  Memory mapped after a thread is
+// created is not shared with it, so set up everything the threads work
+// on before creating them.  Beyond what is here, the library keeps no
+// locks: calls that share state, such as file and network I/O, must
+// not run in more than one thread at a time.
+//
+// Mutexes and condition variables keep to user space as long as there
+// is no contention, and otherwise sleep in sys_futex_wait, which works
+// because the threads map the same physical pages.
+
+#include <inc/lib.h>
+
+// What each thread left for uthread_join, by environment index
+static struct {
+	uthread_t ue_thread;
+	void *ue_retval;
+} uthread_exits[NENV];
+
+// Start a thread running fn(arg), and store it in *t.
+// Returns 0 on success, < 0 on error.
+int
+uthread_create(uthread_t *t, void *(*fn)(void *), void *arg)
+{
+	envid_t envid;
+
+	if ((envid = sfork()) < 0)
+		return envid;
+	if (envid == 0)
+		uthread_exit(fn(arg));
+	*t = envid;
+	return 0;
+}
+
+// End the calling thread, leaving 'retval' for uthread_join.  Unlike
+// exit, this leaves the file descriptors alone, since they are shared.
+void
+uthread_exit(void *retval)
+{
+	uthread_t self = uthread_self();
+
+	uthread_exits[ENVX(self)].ue_retval = retval;
+	uthread_exits[ENVX(self)].ue_thread = self;
+	sys_env_destroy(0);
+	panic("uthread_exit: still running");
+}
+
+// Wait until thread t ends, and store what it passed to uthread_exit,
+// or returned from its function, in *retval_store if that is not NULL.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if t is the calling thread.
+int
+uthread_join(uthread_t t, void **retval_store)
+{
+	if (t == uthread_self())
+		return -E_INVAL;
+	wait(t);
+	if (retval_store)
+		*retval_store = uthread_exits[ENVX(t)].ue_thread == t ?
+			uthread_exits[ENVX(t)].ue_retval : NULL;
+	return 0;
+}
+
+uthread_t
+uthread_self(void)
+{
+	return thisenv->env_id;
+}
+
+void
+umutex_init(struct Umutex *m)
+{
+	m->um_state = 0;
+}
+
+// Take the mutex, sleeping while another thread holds it.
+void
+umutex_lock(struct Umutex *m)
+{
+	uint32_t state;
+
+	if ((state = __sync_val_compare_and_swap(&m->um_state, 0, 1)) == 0)
+		return;
+	// Mark it contended, so the holder wakes us when it lets go.
+	// Whoever takes it this way keeps it marked, since others may
+	// still be asleep.
+	if (state != 2)
+		state = __sync_lock_test_and_set(&m->um_state, 2);
+	while (state != 0) {
+		sys_futex_wait(&m->um_state, 2, 0);
+		state = __sync_lock_test_and_set(&m->um_state, 2);
+	}
+}
+
+// Take the mutex if it is free.  Returns whether it was.
+bool
+umutex_trylock(struct Umutex *m)
+{
+	return __sync_bool_compare_and_swap(&m->um_state, 0, 1);
+}
+
+void
+umutex_unlock(struct Umutex *m)
+{
+	if (__sync_fetch_and_sub(&m->um_state, 1) != 1) {
+		m->um_state = 0;
+		sys_futex_wake(&m->um_state, 1);
+	}
+}
+
+void
+ucond_init(struct Ucond *c)
+{
+	c->uc_seq = 0;
+}
+
+// Let go of m, which the caller holds, and sleep until the condition is
+// signalled, then take m again.  As with any condition variable, the
+// caller must check its condition again once this returns.
+void
+ucond_wait(struct Ucond *c, struct Umutex *m)
+{
+	uint32_t seq = c->uc_seq;
+
+	umutex_unlock(m);
+	// Fails at once if there was a signal since we let go of m
+	sys_futex_wait(&c->uc_seq, seq, 0);
+	umutex_lock(m);
+}
+
+// Wake one thread waiting on the condition.
+void
+ucond_signal(struct Ucond *c)
+{
+	__sync_fetch_and_add(&c->uc_seq, 1);
+	sys_futex_wake(&c->uc_seq, 1);
+}
+
+// Wake every thread waiting on the condition.
+void
+ucond_broadcast(struct Ucond *c)
+{
+	__sync_fetch_and_add(&c->uc_seq, 1);
+	sys_futex_wake(&c->uc_seq, NENV);
+}
@@ -1,6 +1,6 @@
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+static union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
 #define NBUFF (PTSIZE / PGSIZE)
 
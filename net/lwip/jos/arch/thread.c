@@ -47,7 +47,12 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// With no other thread to run, nothing can wake us before the
+	// timeout, so sleep instead of spinning on the clock.
+	if (thread_queue.tq_first)
+	    thread_yield();
+	else
+	    sys_sleep(MIN(msec - p, 1000) * 1000);
 	p = sys_time_msec();
     }
 
@@ -7,9 +7,10 @@
 
 #define TIMER_INTERVAL 250
 
-// Virtual address at which to receive page mappings containing client requests.
+// Virtual address at which to receive page mappings containing client
+// requests, NSIPC_MAXPAGES pages for each.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQVA		(0x0ffff000 - QUEUE_SIZE * NSIPC_MAXPAGES * PGSIZE)
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
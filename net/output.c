@@ -1,7 +1,7 @@
 #include "ns.h"
 #include "kern/e1000.h"
 
-extern union Nsipc nsipcbuf;
+static union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
 void
 output(envid_t ns_envid)
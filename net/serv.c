@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * NSIPC_MAXPAGES * PGSIZE);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / (NSIPC_MAXPAGES * PGSIZE);
 	buse[i] = 0;
 }
 
@@ -181,12 +181,14 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	size_t reqlen;		// Bytes of request pages from req on
 };
 
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
 	union Nsipc *req = args->req;
+	size_t i;
 	int r;
 
 	switch (args->reqno) {
@@ -219,10 +221,19 @@ serve_thread(uint32_t a) {
 	case NSREQ_RECV:
 		// Note that we read the request fields before we
 		// overwrite it with the response data.
+		// Data past the first page goes into the pages the
+		// client sent along.
 		r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-			      req->recv.req_len, req->recv.req_flags);
+			      MIN(req->recv.req_len, args->reqlen
+				  - offsetof(struct Nsret_recv, ret_buf)),
+			      req->recv.req_flags);
 		break;
 	case NSREQ_SEND:
+		if (req->send.req_size < 0 || req->send.req_size > args->reqlen
+		    - offsetof(struct Nsreq_send, req_buf)) {
+			r = -E_INVAL;
+			break;
+		}
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
@@ -250,7 +261,8 @@ serve_thread(uint32_t a) {
 		ipc_send(args->whom, r, 0, 0);
 
 	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	for (i = 0; i < args->reqlen; i += PGSIZE)
+		sys_page_unmap(0, (char *) args->req + i);
 	free(args);
 }
 
@@ -270,7 +282,8 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_recv((int32_t *) &whom, IPC_PAGES(va, NSIPC_MAXPAGES),
+				 &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -297,6 +310,7 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		args->reqlen = thisenv->env_ipc_npages * PGSIZE;
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -318,6 +332,10 @@ umain(int argc, char **argv)
 
 	binaryname = "ns";
 
+	// Keep the network server and its helpers, which inherit this,
+	// off the file server's CPU, if there is another one.
+	sys_env_set_affinity(0, 1 << 1);
+
 	// fork off the timer thread which will send us periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
@@ -0,0 +1,79 @@
+// Compare one-way message throughput of a shared-memory channel
+// against an ipc_send/ipc_recv pair per message.
+
+#include <inc/lib.h>
+
+#define NMSG		20000
+#define MSGSIZE		64
+
+#define CHANVA		((void *) 0xA0000000)
+
+static void
+consumer(struct Chan *c, envid_t parent)
+{
+	uint32_t msg[MSGSIZE / 4];
+	envid_t who;
+	int i, r;
+
+	for (i = 0; i < NMSG; i++) {
+		if ((r = chan_recv(c, msg, sizeof(msg))) != sizeof(msg))
+			panic("chan_recv: %e", r);
+		if (msg[0] != i || msg[MSGSIZE / 4 - 1] != ~i)
+			panic("message %d came as %d", i, msg[0]);
+	}
+	if ((r = chan_recv(c, msg, sizeof(msg))) != -E_EOF)
+		panic("chan_recv after close returned %e", r);
+	ipc_send(parent, 0, 0, 0);
+
+	for (i = 0; i < NMSG; i++)
+		if ((r = ipc_recv(&who, 0, 0)) != i)
+			panic("ipc_recv got %d, not %d", r, i);
+	ipc_send(parent, 0, 0, 0);
+}
+
+static void
+report(const char *what, uint64_t start)
+{
+	uint64_t nsec = sys_time_nsec() - start;
+
+	cprintf("%s: %d messages, %u ns each, %u per second\n",
+		what, NMSG, (unsigned) (nsec / NMSG),
+		(unsigned) (NMSG * 1000000000ULL / nsec));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t msg[MSGSIZE / 4];
+	uint64_t start;
+	struct Chan c;
+	envid_t child;
+	int i, r;
+
+	if ((r = chan_create(&c, CHANVA)) < 0)
+		panic("chan_create: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		consumer(&c, thisenv->env_parent_id);
+		return;
+	}
+
+	memset(msg, 0, sizeof(msg));
+	start = sys_time_nsec();
+	for (i = 0; i < NMSG; i++) {
+		msg[0] = i;
+		msg[MSGSIZE / 4 - 1] = ~i;
+		if ((r = chan_send(&c, msg, sizeof(msg))) < 0)
+			panic("chan_send: %e", r);
+	}
+	chan_close(&c);
+	ipc_recv(0, 0, 0);
+	report("channel", start);
+
+	start = sys_time_nsec();
+	for (i = 0; i < NMSG; i++)
+		ipc_send(child, i, 0, 0);
+	ipc_recv(0, 0, 0);
+	report("ipc_send/ipc_recv", start);
+}
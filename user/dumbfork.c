@@ -71,6 +71,9 @@ dumbfork(void)
 	// Also copy the stack we are currently running on.
 	duppage(envid, ROUNDDOWN(&addr, PGSIZE));
 
+	// And the thread-local page, where thisenv lives.
+	duppage(envid, (void *) UTLS);
+
 	// Start the child environment running
 	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
 		panic("sys_env_set_status: %e", r);
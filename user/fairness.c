@@ -1,13 +1,49 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+// The receiver also reports how the CPU time is shared between them.
+// The two senders share CPU 0, env 3 at a higher priority than env 2,
+// and keep it busy retrying their sends, so the fair scheduler must
+// give env 3 the larger share.
 
 #include <inc/lib.h>
 
+#define NREPORT		1000	// Messages between CPU share reports
+#define NCHECK		5	// Reports before the shares are checked
+#define HIGH_PRIO	(ENV_PRIO_MIN + 4)
+
+static void
+report(void)
+{
+	static int nreports;
+	uint64_t total = 0;
+	int i;
+
+	for (i = 1; i <= 3; i++)
+		if (envs[i].env_status != ENV_FREE)
+			total += envs[i].env_runtime;
+	if (total == 0)
+		return;
+
+	cprintf("cpu share:");
+	for (i = 1; i <= 3; i++)
+		if (envs[i].env_status != ENV_FREE)
+			cprintf(" %x %d%%", envs[i].env_id,
+				(int) (envs[i].env_runtime * 100 / total));
+	cprintf("\n");
+
+	if (++nreports >= NCHECK
+	    && envs[2].env_status != ENV_FREE && envs[3].env_status != ENV_FREE
+	    && envs[3].env_runtime <= envs[2].env_runtime)
+		panic("priority %d env %x got no more CPU time than priority %d env %x",
+		      HIGH_PRIO, envs[3].env_id, ENV_PRIO_MIN, envs[2].env_id);
+}
+
 void
 umain(int argc, char **argv)
 {
 	envid_t who, id;
+	int n = 0;
 
 	id = sys_getenvid();
 
@@ -15,11 +51,17 @@ umain(int argc, char **argv)
 		while (1) {
 			ipc_recv(&who, 0, 0);
 			cprintf("%x recv from %x\n", id, who);
+			if (++n % NREPORT == 0)
+				report();
 		}
 	} else {
+		sys_env_set_affinity(0, 1 << 0);
+		if (thisenv == &envs[3])
+			sys_env_set_priority(HIGH_PRIO);
 		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
+		// Retry without yielding, so that only the scheduler
+		// decides how the CPU is shared
 		while (1)
-			ipc_send(envs[1].env_id, 0, 0, 0);
+			sys_ipc_try_send(envs[1].env_id, 0, (void *) UTOP, 0);
 	}
 }
-
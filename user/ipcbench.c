@@ -0,0 +1,66 @@
+// Compare IPC round-trip latency of ipc_send/ipc_recv pairs, as in
+// pingpong, against ipc_call/ipc_reply_wait, which switch straight to
+// the partner env.  Both envs run on CPU 0.
+
+#include <inc/lib.h>
+
+#define NROUNDS		10000
+
+static void
+server(void)
+{
+	envid_t who;
+	int32_t v;
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		v = ipc_recv(&who, 0, 0);
+		ipc_send(who, v + 1, 0, 0);
+	}
+
+	who = 0;
+	v = 0;
+	for (i = 0; i < NROUNDS; i++)
+		v = ipc_reply_wait(who, v + 1, 0, 0, &who, 0, 0);
+	ipc_send(who, v + 1, 0, 0);
+}
+
+static void
+report(const char *what, uint64_t start)
+{
+	uint64_t nsec = sys_time_nsec() - start;
+
+	cprintf("%s: %d round trips, %u ns each\n",
+		what, NROUNDS, (unsigned) (nsec / NROUNDS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		server();
+		return;
+	}
+
+	start = sys_time_nsec();
+	for (i = 0; i < NROUNDS; i++) {
+		ipc_send(child, i, 0, 0);
+		if ((r = ipc_recv(0, 0, 0)) != i + 1)
+			panic("send/recv got %d, not %d", r, i + 1);
+	}
+	report("send/recv", start);
+
+	start = sys_time_nsec();
+	for (i = 0; i < NROUNDS; i++)
+		if ((r = ipc_call(child, i, 0, 0, 0, 0)) != i + 1)
+			panic("call got %d, not %d", r, i + 1);
+	report("call/reply_wait", start);
+}
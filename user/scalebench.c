@@ -0,0 +1,87 @@
+// Run N independent workers at once, for N = 1, 2, 4, and time how
+// long they take.  Each worker either allocates and unmaps a page in
+// a loop, or plays IPC ping-pong with a partner of its own.  On a
+// kernel whose locks let them run in parallel, the time stays about
+// the same as N grows, up to the number of CPUs.
+
+#include <inc/lib.h>
+
+#define MAXWORKERS	4
+#define NALLOC		20000
+#define NPINGPONG	5000
+
+static char *va = (char *) 0x10000000;
+
+static void
+alloc_loop(void)
+{
+	int i, r;
+
+	for (i = 0; i < NALLOC; i++) {
+		if ((r = sys_page_alloc(0, va, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+}
+
+static void
+ipc_loop(void)
+{
+	envid_t peer, who;
+	int i;
+
+	if ((peer = fork()) < 0)
+		panic("fork: %e", peer);
+	if (peer == 0) {
+		// Echo every value back to the parent worker.
+		for (i = 0; i < NPINGPONG; i++) {
+			uint32_t v = ipc_recv(&who, 0, 0);
+			ipc_send(who, v, 0, 0);
+		}
+		return;
+	}
+	for (i = 0; i < NPINGPONG; i++) {
+		ipc_send(peer, i, 0, 0);
+		if (ipc_recv(&who, 0, 0) != i || who != peer)
+			panic("ipc_loop: bad reply");
+	}
+	wait(peer);
+}
+
+// Run n copies of fn at once and return how long they took, in ms.
+static unsigned
+run(int n, void (*fn)(void))
+{
+	envid_t workers[MAXWORKERS];
+	unsigned start;
+	int i;
+
+	start = sys_time_msec();
+	for (i = 0; i < n; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			fn();
+			exit();
+		}
+	}
+	for (i = 0; i < n; i++)
+		wait(workers[i]);
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned alloc_ms, ipc_ms;
+	int n;
+
+	for (n = 1; n <= MAXWORKERS; n *= 2) {
+		alloc_ms = run(n, alloc_loop);
+		ipc_ms = run(n, ipc_loop);
+		cprintf("%d workers: %d page allocs each in %d ms, "
+			"%d round trips each in %d ms\n",
+			n, NALLOC, alloc_ms, NPINGPONG, ipc_ms);
+	}
+}
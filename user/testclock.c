@@ -0,0 +1,36 @@
+// Check that the microsecond and nanosecond clocks are monotonic,
+// agree with sys_time_msec, and resolve well under a millisecond.
+
+#include <inc/lib.h>
+
+#define NSAMPLES	10000
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t prev, now, step, min_step = ~0ULL;
+	unsigned msec;
+	int i;
+
+	prev = sys_time_nsec();
+	for (i = 0; i < NSAMPLES; i++) {
+		now = sys_time_nsec();
+		if (now < prev)
+			panic("sys_time_nsec went backwards");
+		step = now - prev;
+		if (step > 0 && step < min_step)
+			min_step = step;
+		prev = now;
+	}
+	if (min_step >= 1000000)
+		panic("sys_time_nsec resolution %u ns", (unsigned) min_step);
+
+	msec = sys_time_msec();
+	now = sys_time_usec();
+	if (now / 1000 < msec || now / 1000 > msec + 10)
+		panic("sys_time_usec %u ms, sys_time_msec %u ms",
+		      (unsigned) (now / 1000), msec);
+
+	cprintf("clock resolution %u ns\n", (unsigned) min_step);
+	cprintf("testclock OK\n");
+}
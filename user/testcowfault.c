@@ -0,0 +1,63 @@
+// Check that the kernel resolves copy-on-write faults without the page
+// fault upcall: by copying pages that are still shared, and by taking
+// over the ones no other env maps any more.
+
+#include <inc/lib.h>
+
+#define HEAP		((char *) 0xA0000000)
+#define NHEAP		64
+
+static void
+handler(struct UTrapframe *utf)
+{
+	panic("upcall for va %08x, err %x", utf->utf_fault_va, utf->utf_err);
+}
+
+static void
+touch(char c)
+{
+	uint32_t faults = thisenv->env_cow_faults;
+	uint32_t copies = thisenv->env_cow_copies;
+	int i;
+
+	for (i = 0; i < NHEAP; i++)
+		HEAP[i * PGSIZE] = c;
+	cprintf("%s: %d cow faults, %d copies\n",
+		c == 'c' ? "child" : "parent",
+		thisenv->env_cow_faults - faults, thisenv->env_cow_copies - copies);
+	if (thisenv->env_cow_faults - faults < NHEAP)
+		panic("writes to the heap were not copy-on-write faults");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int i, r;
+
+	for (i = 0; i < NHEAP; i++)
+		if ((r = sys_page_alloc(0, HEAP + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	set_pgfault_handler(handler);
+	if (child == 0) {
+		// The parent still maps every page
+		touch('c');
+		if (thisenv->env_cow_copies < NHEAP)
+			panic("shared pages were not copied");
+		return;
+	}
+
+	// With the child gone, the pages are ours alone
+	wait(child);
+	i = thisenv->env_cow_copies;
+	touch('p');
+	if (thisenv->env_cow_copies != i)
+		panic("pages only we map were copied");
+	for (i = 0; i < NHEAP; i++)
+		if (HEAP[i * PGSIZE] != 'p')
+			panic("heap page %d lost our write", i);
+	cprintf("testcowfault OK\n");
+}
@@ -0,0 +1,58 @@
+// Check that fork leaves private pages copy-on-write and PTE_SHARE
+// pages shared, and time forking an env with a 4MB heap.
+
+#include <inc/lib.h>
+
+#define HEAP		((char *) 0xA0000000)
+#define NHEAP		1024
+#define SHARED		((volatile int *) 0xB0000000)
+#define NFORK		20
+
+static int counter = 1;
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i, r;
+
+	for (i = 0; i < NHEAP; i++) {
+		if ((r = sys_page_alloc(0, HEAP + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		HEAP[i * PGSIZE] = i;
+	}
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (!(uvpt[PGNUM(&counter)] & PTE_COW)
+		    || (uvpt[PGNUM(HEAP)] & PTE_W))
+			panic("private pages are not copy-on-write in the child");
+		if (!(uvpt[PGNUM(SHARED)] & PTE_W))
+			panic("shared page is not writable in the child");
+		counter = 2;
+		HEAP[0] = 'c';
+		*SHARED = 1;
+		return;
+	}
+	wait(child);
+	if (counter != 1 || HEAP[0] != 0)
+		panic("the child's writes showed through");
+	if (*SHARED != 1)
+		panic("the child's write to the shared page did not show");
+
+	start = sys_time_nsec();
+	for (i = 0; i < NFORK; i++) {
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			return;
+		wait(child);
+	}
+	cprintf("fork with a %d page heap: %u ns each\n",
+		NHEAP, (unsigned) ((sys_time_nsec() - start) / NFORK));
+	cprintf("testforkcow OK\n");
+}
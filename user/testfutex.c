@@ -0,0 +1,63 @@
+// Ping-pong a counter between two envs that share a page at different
+// addresses, sleeping on it with futexes.
+
+#include <inc/lib.h>
+
+#define NROUNDS		1000
+
+static volatile uint32_t *parent_word = (volatile uint32_t *) 0xA0000000;
+static volatile uint32_t *child_word = (volatile uint32_t *) 0xB0000000;
+
+// Wait for *w to reach 'val', then move it on and wake the other side.
+static void
+take_turn(volatile uint32_t *w, uint32_t val)
+{
+	uint32_t cur;
+	int r;
+
+	while ((cur = *w) != val)
+		if ((r = sys_futex_wait(w, cur, 0)) < 0 && r != -E_AGAIN)
+			panic("sys_futex_wait: %e", r);
+	*w = val + 1;
+	if ((r = sys_futex_wake(w, 1)) < 0)
+		panic("sys_futex_wake: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) parent_word, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_futex_wait(parent_word, 1, 0)) != -E_AGAIN)
+		panic("sys_futex_wait on a changed word returned %e", r);
+	start = sys_time_usec();
+	if ((r = sys_futex_wait(parent_word, 0, 20000)) != -E_TIMEOUT)
+		panic("sys_futex_wait returned %e, not a timeout", r);
+	if (sys_time_usec() - start < 20000)
+		panic("sys_futex_wait timed out early");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_page_map(0, (void *) parent_word, 0, (void *) child_word,
+				      PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			panic("sys_page_map: %e", r);
+		for (i = 0; i < NROUNDS; i++)
+			take_turn(child_word, 2 * i + 1);
+		return;
+	}
+
+	start = sys_time_usec();
+	for (i = 0; i < NROUNDS; i++)
+		take_turn(parent_word, 2 * i);
+	take_turn(parent_word, 2 * NROUNDS);
+	cprintf("%d futex round trips in %u usec\n",
+		NROUNDS, (unsigned) (sys_time_usec() - start));
+
+	wait(child);
+	cprintf("testfutex OK\n");
+}
@@ -0,0 +1,47 @@
+// Check that blocked senders queue up on a busy receiver, come out in
+// priority order, and fail if the receiver exits without receiving.
+
+#include <inc/lib.h>
+
+#define NSENDERS	8
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, who, child;
+	int seen[NSENDERS] = { 0 };
+	int i, r;
+
+	for (i = 0; i < NSENDERS; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			// The last sender jumps the queue
+			if (i == NSENDERS - 1)
+				sys_env_set_priority(ENV_PRIO_MIN + 1);
+			ipc_send(parent, i, 0, 0);
+			return;
+		}
+	}
+
+	// Let them all block on us
+	sys_sleep(100000);
+	for (i = 0; i < NSENDERS; i++) {
+		r = ipc_recv(&who, 0, 0);
+		if (r < 0 || r >= NSENDERS || seen[r]++)
+			panic("bad message %d from %08x", r, who);
+		if (i == 0 && r != NSENDERS - 1)
+			panic("sender %d came before the high-priority one", r);
+	}
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_sleep(20000);
+		return;
+	}
+	if ((r = sys_ipc_send(child, 0, (void *) UTOP, 0)) != -E_BAD_ENV)
+		panic("send to an exiting env returned %e", r);
+
+	cprintf("testipcqueue OK\n");
+}
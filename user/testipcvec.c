@@ -0,0 +1,156 @@
+// Send scattered runs of pages in one IPC, check that bad vectors and
+// messages too big for the receive window fail as a whole, that an
+// unreadable vector kills the sender, and read a file in large chunks
+// through the file server's block cache pages.
+
+#include <inc/lib.h>
+
+#define SRC		((char *) 0xA0000000)
+#define WIN		((char *) 0xB0000000)
+#define NWIN		8
+
+static void
+fill(char *va, int npages, char c)
+{
+	int i, r;
+
+	for (i = 0; i < npages; i++) {
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(va + i * PGSIZE, c + i, PGSIZE);
+	}
+}
+
+static void
+sender(envid_t parent)
+{
+	struct IpcVec vec[IPC_MAXVEC + 1];
+	int i, r;
+
+	fill(SRC, 1, 'a');
+	fill(SRC + 4 * PGSIZE, 3, 'b');
+	fill(SRC + 16 * PGSIZE, 2, 'x');
+	vec[0] = (struct IpcVec) { SRC + 4 * PGSIZE, 3, PTE_P|PTE_U|PTE_W };
+	vec[1] = (struct IpcVec) { SRC, 1, PTE_P|PTE_U };
+	vec[2] = (struct IpcVec) { SRC + 16 * PGSIZE, 2, PTE_P|PTE_U };
+
+	// Bad vectors fail at once, whether or not the parent receives
+	if ((r = sys_ipc_send_vec(parent, 0, vec, IPC_MAXVEC + 1)) != -E_INVAL)
+		panic("too many runs: %e", r);
+	vec[3] = (struct IpcVec) { SRC + 8 * PGSIZE, 1, PTE_P|PTE_U };
+	if ((r = sys_ipc_send_vec(parent, 0, vec, 4)) != -E_INVAL)
+		panic("unmapped page: %e", r);
+	vec[3] = (struct IpcVec) { SRC + 1, 1, PTE_P|PTE_U };
+	if ((r = sys_ipc_send_vec(parent, 0, vec, 4)) != -E_INVAL)
+		panic("unaligned run: %e", r);
+	for (i = 3; i < IPC_MAXVEC; i++)
+		vec[i] = (struct IpcVec) { SRC + 4 * PGSIZE, 3, PTE_P|PTE_U };
+	if ((r = sys_ipc_send_vec(parent, 0, vec, IPC_MAXVEC)) != -E_INVAL)
+		panic("too many pages: %e", r);
+
+	// 1: all six pages, gathered from three runs
+	ipc_send_vec(parent, 1, vec, 3);
+	// 2: more than the parent's window of two pages fails as a
+	// whole, and the parent goes on waiting
+	if ((r = sys_ipc_send_vec(parent, 2, vec, 3)) != -E_INVAL)
+		panic("send beyond the window: %e", r);
+	// 3: a run of pages through the classic send
+	ipc_send(parent, 3, IPC_PAGES(SRC + 4 * PGSIZE, 2), PTE_P|PTE_U);
+	// 4: pages to a receiver that takes none
+	ipc_send_vec(parent, 4, vec, 3);
+}
+
+static void
+check_page(int i, char c)
+{
+	char *p = WIN + i * PGSIZE;
+
+	if (p[0] != c || p[PGSIZE - 1] != c)
+		panic("window page %d holds %c, not %c", i, p[0], c);
+}
+
+// A vector the sender cannot read kills the sender
+static void
+check_bad_vec(envid_t parent)
+{
+	volatile int *survived = (volatile int *) (SRC + 32 * PGSIZE);
+	envid_t child;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) survived, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*survived = 0;
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_ipc_send_vec(parent, 5, (struct IpcVec *) (SRC + 40 * PGSIZE), 1);
+		*survived = 1;
+		return;
+	}
+	wait(child);
+	if (*survived)
+		panic("sys_ipc_send_vec read an unmapped vector");
+}
+
+static void
+check_read(const char *path)
+{
+	static char small[40000], large[40000];
+	int fd, n, r, total;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	for (total = 0; total < sizeof(small); total += n)
+		if ((n = read(fd, small + total, 1000)) <= 0)
+			break;
+	// Start off the block boundary, so the data starts mid-window
+	seek(fd, 100);
+	for (n = 100; n < total; n += r)
+		if ((r = read(fd, large + n, sizeof(large) - n)) <= 0)
+			panic("read %s at %d: %e", path, n, r);
+	if (total <= 2 * PGSIZE || memcmp(small + 100, large + 100, total - 100) != 0)
+		panic("large reads of %s differ from small ones", path);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who, child, parent = thisenv->env_id;
+	int perm, r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sender(parent);
+		return;
+	}
+
+	if ((r = ipc_recv(&who, IPC_PAGES(WIN, NWIN), &perm)) != 1)
+		panic("ipc_recv returned %e, not 1", r);
+	if (thisenv->env_ipc_npages != 6 || perm != (PTE_P|PTE_U|PTE_W))
+		panic("got %d pages with perm %x", thisenv->env_ipc_npages, perm);
+	check_page(0, 'b');
+	check_page(1, 'c');
+	check_page(2, 'd');
+	check_page(3, 'a');
+	check_page(4, 'x');
+	check_page(5, 'y');
+	if (uvpt[PGNUM(WIN + 3 * PGSIZE)] & PTE_W)
+		panic("read-only run mapped writable");
+
+	if ((r = ipc_recv(&who, IPC_PAGES(WIN, 2), &perm)) != 3)
+		panic("ipc_recv returned %e, not 3", r);
+	if (thisenv->env_ipc_npages != 2)
+		panic("got %d pages, not 2", thisenv->env_ipc_npages);
+	check_page(0, 'b');
+	check_page(1, 'c');
+
+	if ((r = ipc_recv(&who, 0, &perm)) != 4 || perm != 0)
+		panic("ipc_recv returned %e with perm %x", r, perm);
+
+	wait(child);
+	check_bad_vec(parent);
+	check_read("/init");
+	cprintf("testipcvec OK\n");
+}
@@ -0,0 +1,67 @@
+// Check that sys_sleep and receive timeouts wake up on time, and that
+// a message beats the timeout.
+
+#include <inc/lib.h>
+
+static const uint32_t naps[] = { 0, 1000, 3000, 20000, 70000, 300000 };
+
+#define NAPS		(sizeof(naps) / sizeof(naps[0]))
+
+// Wake-ups may be late by a wheel tick plus scheduling delays
+#define SLACK_USEC	50000
+
+static void
+check(const char *what, uint32_t usec, uint64_t start)
+{
+	uint64_t slept = sys_time_usec() - start;
+
+	if (slept < usec || slept > usec + SLACK_USEC)
+		panic("%s %u usec took %u usec", what, usec, (unsigned) slept);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	envid_t who, parent = thisenv->env_id;
+	int i, r;
+
+	for (i = 0; i < NAPS; i++) {
+		start = sys_time_usec();
+		if ((r = sys_sleep(naps[i])) < 0)
+			panic("sys_sleep: %e", r);
+		check("sleep", naps[i], start);
+	}
+
+	// Sleepers on all levels of the wheel at once
+	for (i = 0; i < NAPS; i++)
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		else if (r == 0) {
+			start = sys_time_usec();
+			sys_sleep(naps[NAPS - 1 - i]);
+			check("concurrent sleep", naps[NAPS - 1 - i], start);
+			ipc_send(parent, i, 0, 0);
+			return;
+		}
+	for (i = 0; i < NAPS; i++)
+		if ((r = ipc_recv_timeout(&who, 0, 0, 2000000)) < 0)
+			panic("sleeper %d: %e", i, r);
+
+	start = sys_time_usec();
+	if ((r = ipc_recv_timeout(&who, 0, 0, 30000)) != -E_TIMEOUT)
+		panic("ipc_recv_timeout returned %e, not a timeout", r);
+	check("receive timeout", 30000, start);
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		sys_sleep(10000);
+		ipc_send(parent, 42, 0, 0);
+		return;
+	}
+	if ((r = ipc_recv_timeout(&who, 0, 0, 1000000)) != 42)
+		panic("ipc_recv_timeout returned %d, not the message", r);
+
+	cprintf("testsleep OK\n");
+}
@@ -0,0 +1,95 @@
+// Check that calls queued on the syscall ring run in order with their
+// results reported, and compare mapping pages one system call at a
+// time against a batch per ring.
+
+#include <inc/lib.h>
+
+#define VA		0xA0000000
+#define NPAGES		512
+
+static struct SysRing ring __attribute__((aligned(PGSIZE)));
+
+static void
+check_raw(void)
+{
+	struct SysSqe *sqe;
+	int r;
+
+	if ((r = sys_ring_enter()) != -E_INVAL)
+		panic("sys_ring_enter without a ring returned %e", r);
+	if ((r = sys_ring_setup((struct SysRing *) (VA + 1))) != -E_INVAL)
+		panic("sys_ring_setup of an unaligned ring returned %e", r);
+	if ((r = sys_ring_setup(&ring)) < 0)
+		panic("sys_ring_setup: %e", r);
+
+	sqe = &ring.sr_sq[ring.sr_sq_tail % SYSRING_NSQ];
+	*sqe = (struct SysSqe) { SYS_page_alloc, { 0, VA, PTE_P|PTE_U|PTE_W }, 1 };
+	ring.sr_sq_tail++;
+	sqe = &ring.sr_sq[ring.sr_sq_tail % SYSRING_NSQ];
+	*sqe = (struct SysSqe) { SYS_yield, { 0 }, 2 };
+	ring.sr_sq_tail++;
+	sqe = &ring.sr_sq[ring.sr_sq_tail % SYSRING_NSQ];
+	*sqe = (struct SysSqe) { SYS_page_unmap, { 0, VA }, 3 };
+	ring.sr_sq_tail++;
+	if ((r = sys_ring_enter()) != 3)
+		panic("sys_ring_enter ran %e calls, not 3", r);
+	if (ring.sr_sq_head != 3 || ring.sr_cq_tail != 3
+	    || ring.sr_cq[0].cqe_data != 1 || ring.sr_cq[0].cqe_result != 0
+	    || ring.sr_cq[1].cqe_data != 2 || ring.sr_cq[1].cqe_result != -E_INVAL
+	    || ring.sr_cq[2].cqe_data != 3 || ring.sr_cq[2].cqe_result != 0)
+		panic("bad completions");
+	if (uvpt[PGNUM(VA)] & PTE_P)
+		panic("page still mapped");
+
+	if ((r = sys_ring_setup(NULL)) < 0)
+		panic("sys_ring_setup(NULL): %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	uint32_t data;
+	int i, r;
+
+	check_raw();
+
+	if ((r = sys_page_alloc(0, (void *) VA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*(int *) VA = 42;
+
+	start = sys_time_nsec();
+	for (i = 1; i <= NPAGES; i++)
+		if ((r = sys_page_map(0, (void *) VA, 0, (void *) (VA + i * PGSIZE),
+				      PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	cprintf("%d sys_page_map calls: %u ns\n",
+		NPAGES, (unsigned) (sys_time_nsec() - start));
+
+	start = sys_time_nsec();
+	for (i = 1; i <= NPAGES; i++)
+		if ((r = sysring_queue(i, SYS_page_map, 0, VA, 0, VA + i * PGSIZE,
+				       PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sysring_queue: %e", r);
+	if ((r = sysring_flush(NULL)) < 0)
+		panic("sysring_flush: %e", r);
+	cprintf("%d ring page maps: %u ns\n",
+		NPAGES, (unsigned) (sys_time_nsec() - start));
+	for (i = 1; i <= NPAGES; i++)
+		if (*(int *) (VA + i * PGSIZE) != 42
+		    || !(uvpt[PGNUM(VA + i * PGSIZE)] & PTE_W))
+			panic("page %d not mapped by the ring", i);
+
+	// Failures are reported with the failed call's data
+	sysring_queue(7, SYS_page_unmap, 0, VA + PGSIZE, 0, 0, 0);
+	sysring_queue(8, SYS_page_map, 0, VA + PGSIZE, 0, VA, PTE_P|PTE_U);
+	sysring_queue(9, SYS_page_unmap, 0, VA + 2 * PGSIZE, 0, 0, 0);
+	if ((r = sysring_flush(&data)) != -E_INVAL || data != 8)
+		panic("sysring_flush returned %e for call %d", r, data);
+	if (uvpt[PGNUM(VA + 2 * PGSIZE)] & PTE_P)
+		panic("calls after a failure did not run");
+	if ((r = sysring_flush(&data)) != 0)
+		panic("second sysring_flush returned %e", r);
+
+	cprintf("testsysring OK\n");
+}
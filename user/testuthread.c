@@ -0,0 +1,93 @@
+// Run threads that count under a mutex and hand items over through a
+// condition variable, and check that each has a thisenv of its own.
+
+#include <inc/lib.h>
+
+#define NTHREAD		4
+#define NCOUNT		2000
+#define NITEM		200
+
+static struct Umutex lock = UMUTEX_INITIALIZER;
+static struct Ucond cond = UCOND_INITIALIZER;
+static uint32_t counter;
+static uint32_t items, taken;
+
+static void *
+count(void *arg)
+{
+	int i;
+
+	if (thisenv->env_id != sys_getenvid())
+		panic("thread %08x has the thisenv of %08x",
+		      sys_getenvid(), thisenv->env_id);
+	for (i = 0; i < NCOUNT; i++) {
+		umutex_lock(&lock);
+		counter++;
+		// Give the others a chance to find the lock held
+		if (i % 100 == 0)
+			sys_yield();
+		umutex_unlock(&lock);
+	}
+	return (void *) ((uintptr_t) arg * 2);
+}
+
+static void *
+consume(void *arg)
+{
+	uint32_t n = 0;
+
+	umutex_lock(&lock);
+	while (taken < NITEM) {
+		while (items == 0 && taken < NITEM)
+			ucond_wait(&cond, &lock);
+		if (items > 0) {
+			items--;
+			taken++;
+			n++;
+		}
+	}
+	umutex_unlock(&lock);
+	// Wake the other consumers, which may wait for the last item
+	ucond_broadcast(&cond);
+	return (void *) n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uthread_t t[NTHREAD];
+	void *ret;
+	uint32_t total;
+	int i, r;
+
+	for (i = 0; i < NTHREAD; i++)
+		if ((r = uthread_create(&t[i], count, (void *) i)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NTHREAD; i++) {
+		if ((r = uthread_join(t[i], &ret)) < 0)
+			panic("uthread_join: %e", r);
+		if ((uintptr_t) ret != i * 2)
+			panic("thread %d returned %d", i, (int) ret);
+	}
+	if (counter != NTHREAD * NCOUNT)
+		panic("counted to %d, not %d", counter, NTHREAD * NCOUNT);
+	if (uthread_join(uthread_self(), &ret) != -E_INVAL)
+		panic("a thread joined itself");
+
+	for (i = 0; i < NTHREAD; i++)
+		if ((r = uthread_create(&t[i], consume, NULL)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NITEM; i++) {
+		umutex_lock(&lock);
+		items++;
+		ucond_signal(&cond);
+		umutex_unlock(&lock);
+	}
+	for (i = 0, total = 0; i < NTHREAD; i++) {
+		uthread_join(t[i], &ret);
+		total += (uint32_t) ret;
+	}
+	if (total != NITEM || items != 0)
+		panic("consumers took %d items, %d left", total, items);
+	cprintf("testuthread OK\n");
+}